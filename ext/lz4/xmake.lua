@@ -0,0 +1,3 @@
+-- lz4 1.9.4 block format, built from the upstream release rather than a
+-- system copy so every platform gets the same encoder
+add_requires("lz4 1.9.4", {system = false, configs = {shared = false}})
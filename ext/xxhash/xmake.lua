@@ -0,0 +1,7 @@
+-- xxHash 0.8.2 header as shipped with zstd 1.5.7, without zstd's local
+-- adaptations that disable XXH3 and prefix the symbols with ZSTD_
+target("xxhash")
+set_kind("headeronly")
+add_includedirs(".", {public = true})
+add_headerfiles("xxhash.h")
+target_end()
@@ -0,0 +1,16 @@
+-- zstd 1.5.7, single threaded encoder and decoder
+target("zstd")
+set_kind("static")
+add_includedirs("lib", {public = true})
+add_rules("basic_settings")
+on_load(function(target)
+	local function rela(p)
+        return path.relative(path.absolute(p, os.scriptdir()), os.projectdir())
+    end
+    -- the x86-64 Huffman decoder loop is GNU assembly, use the C version
+    target:add("defines", "ZSTD_DISABLE_ASM")
+    target:add("headerfiles", rela("lib/*.h"))
+    target:add("files", rela("lib/common/*.c"), rela("lib/compress/*.c"),
+        rela("lib/decompress/*.c"))
+end)
+target_end()
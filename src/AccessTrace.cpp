@@ -0,0 +1,193 @@
+#include "AccessTrace.h"
+#include "FileIO.h"
+#include <algorithm>
+#include <fstream>
+#include <spdlog/spdlog.h>
+#include <sstream>
+#include <string>
+
+namespace John {
+static constexpr char KIND_CHARS[] = {'r', 'w', 'm'};
+// read size when the platform has no prefetch hint
+static constexpr size_t PREFETCH_CHUNK_SIZE = 1024 * 1024;
+
+bool AccessTrace::Save(const std::filesystem::path &path) const {
+  std::ofstream out(path, std::ios::trunc);
+  for (auto &record : records) {
+    auto *file = PathTable::Get().Path(record.file);
+    if (!file) {
+      continue;
+    }
+    out << record.time.count() << ' ' << KIND_CHARS[(size_t)record.kind]
+        << ' ' << record.offset << ' ' << record.size << ' ' << file << '\n';
+  }
+  out.flush();
+  if (!out) {
+    SPDLOG_ERROR("Failed to write access trace {}", path.string());
+    return false;
+  }
+  return true;
+}
+
+bool AccessTrace::Load(const std::filesystem::path &path) {
+  std::ifstream in(path);
+  if (!in) {
+    SPDLOG_ERROR("Failed to open access trace {}", path.string());
+    return false;
+  }
+  std::vector<AccessRecord> loaded;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    std::istringstream fields(line);
+    int64_t time;
+    char kind;
+    AccessRecord record{};
+    fields >> time >> kind >> record.offset >> record.size;
+    auto *kind_end = std::end(KIND_CHARS);
+    auto *kind_iter = std::find(std::begin(KIND_CHARS), kind_end, kind);
+    std::string file;
+    if (!fields || kind_iter == kind_end ||
+        !std::getline(fields >> std::ws, file) || file.empty()) {
+      SPDLOG_ERROR("Malformed access trace {}: {}", path.string(), line);
+      return false;
+    }
+    record.time = std::chrono::microseconds(time);
+    record.kind = (AccessKind)(kind_iter - std::begin(KIND_CHARS));
+    record.file = PathTable::Get().Intern(file);
+    loaded.push_back(record);
+  }
+  records = std::move(loaded);
+  return true;
+}
+
+void TracePrefetcher::Start(const AccessTrace &trace) {
+  Stop();
+  struct Range {
+    file_handle file;
+    uint64_t offset;
+    uint64_t end;
+    std::chrono::microseconds time;
+  };
+  std::vector<Range> ranges;
+  for (auto &record : trace.Records()) {
+    if (record.kind == AccessKind::Read && record.size) {
+      ranges.push_back({record.file, record.offset,
+                        record.offset + record.size, record.time});
+    }
+  }
+  // merge overlapping reads of a file, the earliest read of a range counts
+  std::sort(ranges.begin(), ranges.end(), [](auto &lhs, auto &rhs) {
+    if (lhs.file.index != rhs.file.index) {
+      return lhs.file.index < rhs.file.index;
+    }
+    return lhs.offset < rhs.offset;
+  });
+  std::vector<Range> merged;
+  for (auto &range : ranges) {
+    auto *last = merged.empty() ? nullptr : &merged.back();
+    if (last && last->file == range.file && range.offset <= last->end) {
+      last->end = std::max(last->end, range.end);
+      last->time = std::min(last->time, range.time);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  std::vector<Range> split;
+  for (auto &range : merged) {
+    for (uint64_t offset = range.offset; offset < range.end;
+         offset += PIECE_SIZE) {
+      split.push_back({range.file, offset,
+                       std::min(range.end, offset + PIECE_SIZE), range.time});
+    }
+  }
+  std::stable_sort(split.begin(), split.end(), [](auto &lhs, auto &rhs) {
+    return lhs.time < rhs.time;
+  });
+  pieces = std::make_unique<Piece[]>(split.size());
+  piece_count = split.size();
+  by_file.clear();
+  for (size_t i = 0; i < split.size(); ++i) {
+    auto &piece = pieces[i];
+    piece.file = split[i].file;
+    piece.offset = split[i].offset;
+    piece.size = split[i].end - split[i].offset;
+    by_file[piece.file.index].push_back(&piece);
+  }
+  for (auto &[index, file_pieces] : by_file) {
+    std::sort(file_pieces.begin(), file_pieces.end(),
+              [](auto *lhs, auto *rhs) { return lhs->offset < rhs->offset; });
+  }
+  next = 0;
+  stopping = false;
+  remaining.store(piece_count, std::memory_order_release);
+  for (size_t i = 0; i < std::min(THREAD_COUNT, piece_count); ++i) {
+    threads.emplace_back([this]() { WorkLoop(); });
+  }
+}
+
+void TracePrefetcher::Stop() {
+  stopping = true;
+  threads.clear();
+  remaining.store(0, std::memory_order_release);
+}
+
+void TracePrefetcher::Cancel(file_handle file, uint64_t offset,
+                             uint64_t size) {
+  auto iter = by_file.find(file.index);
+  if (iter == by_file.end()) {
+    return;
+  }
+  auto &file_pieces = iter->second;
+  // first piece ending after offset
+  auto piece_iter = std::upper_bound(
+      file_pieces.begin(), file_pieces.end(), offset,
+      [](uint64_t offset, const Piece *piece) {
+        return offset < piece->offset + piece->size;
+      });
+  for (; piece_iter != file_pieces.end() &&
+         (*piece_iter)->offset < offset + std::max<uint64_t>(size, 1);
+       ++piece_iter) {
+    auto &piece = **piece_iter;
+    uint8_t expected = PIECE_PENDING;
+    if (piece.file == file &&
+        piece.state.compare_exchange_strong(expected, PIECE_CANCELLED)) {
+      remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+  }
+}
+
+void TracePrefetcher::WorkLoop() {
+  for (size_t index; !stopping && (index = next++) < piece_count;) {
+    auto &piece = pieces[index];
+    uint8_t expected = PIECE_PENDING;
+    if (!piece.state.compare_exchange_strong(expected, PIECE_RUNNING)) {
+      continue;
+    }
+    Fetch(piece);
+    piece.state.store(PIECE_DONE, std::memory_order_release);
+    remaining.fetch_sub(1, std::memory_order_acq_rel);
+  }
+}
+
+void TracePrefetcher::Fetch(const Piece &piece) {
+  auto file = FileCache::Get().Acquire(piece.file, FileAccess::Read);
+  if (!file || FileIO::Prefetch(file->file, piece.offset, piece.size)) {
+    return;
+  }
+  // read and discard, which leaves the range in the page cache as well
+  thread_local std::vector<char> buffer(PREFETCH_CHUNK_SIZE);
+  for (uint64_t done = 0; done < piece.size;) {
+    size_t to_read =
+        (size_t)std::min<uint64_t>(buffer.size(), piece.size - done);
+    int64_t read = FileIO::ReadAt(file->file, buffer.data(), to_read,
+                                  piece.offset + done);
+    if (read <= 0) {
+      return;
+    }
+    done += read;
+  }
+}
+} // namespace John
@@ -0,0 +1,91 @@
+#pragma once
+#include "PathTable.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace John {
+enum class AccessKind : uint8_t {
+  Read,
+  // writes, flushes and space commands
+  Write,
+  // Stat, Open, Close and the other commands without a range
+  Meta,
+};
+// the file side of one executed command
+struct AccessRecord {
+  // from the start of the recording to IOService::Execute
+  std::chrono::microseconds time;
+  file_handle file;
+  uint64_t offset;
+  uint64_t size;
+  AccessKind kind;
+};
+
+// File accesses recorded by IOService, see IOService::StartTraceRecording.
+// Saved as text, one access per line:
+//   <time us> <r|w|m> <offset> <size> <path>
+class AccessTrace {
+  std::vector<AccessRecord> records;
+
+public:
+  void Add(const AccessRecord &record) { records.push_back(record); }
+  std::span<const AccessRecord> Records() const { return records; }
+  bool Save(const std::filesystem::path &path) const;
+  // interns the recorded paths, files need not exist any more
+  bool Load(const std::filesystem::path &path);
+};
+
+// Reads the ranges of a trace into the page cache ahead of demand, in the
+// order they were first read. Overlapping reads are merged and split into
+// pieces of at most PIECE_SIZE. A piece that was not started yet is
+// cancelled once a command reading any of it is executed, the command reads
+// it itself.
+class TracePrefetcher {
+  enum PieceState : uint8_t {
+    PIECE_PENDING,
+    PIECE_RUNNING,
+    PIECE_DONE,
+    PIECE_CANCELLED,
+  };
+  struct Piece {
+    file_handle file;
+    uint64_t offset;
+    uint64_t size;
+    std::atomic_uint8_t state = PIECE_PENDING;
+  };
+  // pieces in replay order
+  std::unique_ptr<Piece[]> pieces;
+  size_t piece_count = 0;
+  // pieces of each file sorted by offset, keyed by path index
+  std::unordered_map<uint32_t, std::vector<Piece *>> by_file;
+  std::atomic_size_t next = 0;
+  std::atomic_size_t remaining = 0;
+  std::atomic_bool stopping = false;
+  std::vector<std::jthread> threads;
+
+  void WorkLoop();
+  static void Fetch(const Piece &piece);
+
+public:
+  static constexpr uint64_t PIECE_SIZE = 4 * 1024 * 1024;
+  static constexpr size_t THREAD_COUNT = 2;
+
+  ~TracePrefetcher() { Stop(); }
+  // the trace is copied, replay starts right away on background threads
+  void Start(const AccessTrace &trace);
+  // pending pieces are dropped, returns once running ones finished
+  void Stop();
+  // true until every piece was fetched or cancelled
+  bool IsActive() const {
+    return remaining.load(std::memory_order_acquire) != 0;
+  }
+  void Cancel(file_handle file, uint64_t offset, uint64_t size);
+};
+} // namespace John
@@ -0,0 +1,125 @@
+#include "BlockCache.h"
+#include <algorithm>
+#include <cstring>
+
+namespace John {
+size_t BlockCache::KeyHash::operator()(const Key &key) const noexcept {
+  // splitmix64 finalizer
+  uint64_t x = key.block ^ ((uint64_t)key.file.index << 40) ^
+               ((uint64_t)key.file.generation << 20);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+BlockCache::BlockCache() {
+  for (auto &epoch : epochs) {
+    epoch.store(1, std::memory_order_relaxed);
+  }
+}
+
+BlockCache &BlockCache::Get() {
+  static BlockCache cache;
+  return cache;
+}
+
+BlockCache::Shard &BlockCache::ShardOf(const Key &key) {
+  // the low bits pick the bucket inside the shard's map
+  return shards[(KeyHash{}(key) >> 32) % SHARD_COUNT];
+}
+
+void BlockCache::SetBudget(size_t budget) {
+  size_t slots_per_shard = budget / BLOCK_SIZE / SHARD_COUNT;
+  enabled = false;
+  for (auto &shard : shards) {
+    std::lock_guard<std::mutex> lk(shard.mutex);
+    shard.index.clear();
+    shard.slots = std::vector<Slot>(slots_per_shard);
+    shard.index.reserve(slots_per_shard);
+    shard.filled = 0;
+    shard.hand = 0;
+  }
+  enabled = slots_per_shard > 0;
+}
+
+bool BlockCache::Read(file_handle file, uint64_t offset, void *dst,
+                      size_t size) {
+  uint64_t epoch = Epoch(file);
+  size_t done = 0;
+  while (done < size) {
+    uint64_t pos = offset + done;
+    Key key{file, pos / BLOCK_SIZE};
+    size_t in_block = pos % BLOCK_SIZE;
+    size_t to_copy = std::min(BLOCK_SIZE - in_block, size - done);
+    auto &shard = ShardOf(key);
+    std::lock_guard<std::mutex> lk(shard.mutex);
+    auto iter = shard.index.find(key);
+    if (iter == shard.index.end()) {
+      misses.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    auto &slot = shard.slots[iter->second];
+    // reads past the end of the file complete short on the backend
+    if (slot.epoch != epoch || in_block + to_copy > slot.size) {
+      misses.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    std::memcpy((uint8_t *)dst + done, slot.data.get() + in_block, to_copy);
+    slot.uses = std::min<uint8_t>(slot.uses + 1, MAX_USES);
+    done += to_copy;
+  }
+  hits.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void BlockCache::Insert(file_handle file, uint64_t epoch, uint64_t offset,
+                        const void *data, size_t size, bool at_end) {
+  uint64_t end = offset + size;
+  for (uint64_t block = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+       block * BLOCK_SIZE < end; ++block) {
+    uint64_t block_offset = block * BLOCK_SIZE;
+    size_t valid = (size_t)std::min<uint64_t>(BLOCK_SIZE, end - block_offset);
+    if (valid < BLOCK_SIZE && !at_end) {
+      break;
+    }
+    // a write was submitted since the read was, the data may be stale
+    if (Epoch(file) != epoch) {
+      return;
+    }
+    Key key{file, block};
+    auto &shard = ShardOf(key);
+    std::lock_guard<std::mutex> lk(shard.mutex);
+    if (shard.slots.empty()) {
+      return;
+    }
+    uint32_t index;
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end()) {
+      index = iter->second;
+    } else if (shard.filled < shard.slots.size()) {
+      index = (uint32_t)shard.filled++;
+      shard.index.emplace(key, index);
+    } else {
+      // every sweep wears one use off, a full sweep at most MAX_USES times
+      while (shard.slots[shard.hand].uses > 0) {
+        --shard.slots[shard.hand].uses;
+        shard.hand = (shard.hand + 1) % shard.slots.size();
+      }
+      index = (uint32_t)shard.hand;
+      shard.hand = (shard.hand + 1) % shard.slots.size();
+      shard.index.erase(shard.slots[index].key);
+      shard.index.emplace(key, index);
+      shard.slots[index].uses = 0;
+    }
+    auto &slot = shard.slots[index];
+    if (!slot.data) {
+      slot.data = std::make_unique<uint8_t[]>(BLOCK_SIZE);
+    }
+    slot.key = key;
+    slot.epoch = epoch;
+    slot.size = (uint32_t)valid;
+    std::memcpy(slot.data.get(),
+                (const uint8_t *)data + (block_offset - offset), valid);
+  }
+}
+} // namespace John
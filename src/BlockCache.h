@@ -0,0 +1,94 @@
+#pragma once
+#include "PathTable.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace John {
+// Process wide cache of file blocks read by IOService, keyed by file and
+// block index. Blocks are spread over shards by hash, each with its own lock
+// and a CLOCK hand. Hits raise a saturating use count that the hand wears
+// down, new blocks enter without one, so blocks read once by a scan are
+// evicted before blocks that are read again. Disabled until a budget is set.
+//
+// Writes make cached data stale through a per-file epoch: readers take the
+// epoch when their command is submitted and blocks are only inserted and
+// only found under the current epoch of their file.
+class BlockCache {
+  struct Key {
+    file_handle file;
+    uint64_t block;
+
+    bool operator==(const Key &) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const noexcept;
+  };
+  struct Slot {
+    Key key;
+    uint64_t epoch = 0;
+    // valid bytes, less than BLOCK_SIZE for the last block of a file
+    uint32_t size = 0;
+    uint8_t uses = 0;
+    std::unique_ptr<uint8_t[]> data;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<Key, uint32_t, KeyHash> index;
+    std::vector<Slot> slots;
+    // slots below filled hold a block
+    size_t filled = 0;
+    size_t hand = 0;
+  };
+  static constexpr size_t SHARD_COUNT = 16;
+  // epochs are shared by files whose path indices collide, which only
+  // invalidates more than needed
+  static constexpr size_t EPOCH_COUNT = 4096;
+  static constexpr uint8_t MAX_USES = 3;
+
+  std::array<Shard, SHARD_COUNT> shards;
+  std::array<std::atomic_uint64_t, EPOCH_COUNT> epochs;
+  std::atomic_bool enabled = false;
+  std::atomic_uint64_t hits = 0;
+  std::atomic_uint64_t misses = 0;
+
+  BlockCache();
+  Shard &ShardOf(const Key &key);
+  std::atomic_uint64_t &EpochOf(file_handle file) {
+    return epochs[file.index % EPOCH_COUNT];
+  }
+
+public:
+  static constexpr size_t BLOCK_SIZE = 16 * 1024;
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  static BlockCache &Get();
+  // Drops every block and caps the cache at budget bytes of block data, zero
+  // disables it. Not meant to race with commands that are in flight.
+  void SetBudget(size_t budget);
+  bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+  // current epoch of the file, never 0
+  uint64_t Epoch(file_handle file) {
+    return EpochOf(file).load(std::memory_order_acquire);
+  }
+  void Invalidate(file_handle file) {
+    EpochOf(file).fetch_add(1, std::memory_order_acq_rel);
+  }
+  // Copies the range to dst if every block of it is cached, false on a miss.
+  // dst may be partially written on a miss.
+  bool Read(file_handle file, uint64_t offset, void *dst, size_t size);
+  // Caches the blocks data covers completely. at_end marks data as ending at
+  // the end of the file, its last block is cached partially then.
+  void Insert(file_handle file, uint64_t epoch, uint64_t offset,
+              const void *data, size_t size, bool at_end);
+  Stats GetStats() const { return {hits.load(), misses.load()}; }
+};
+} // namespace John
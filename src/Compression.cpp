@@ -0,0 +1,159 @@
+#include "Compression.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <lz4.h>
+#include <memory>
+#include <zstd.h>
+
+namespace John {
+static bool Lz4Decompress(const void *src, size_t src_size, void *dst,
+                          size_t dst_size) {
+  if (src_size > LZ4_MAX_INPUT_SIZE || dst_size > LZ4_MAX_INPUT_SIZE) {
+    return false;
+  }
+  // the safe decoder never reads or writes past the given sizes
+  int size = LZ4_decompress_safe(static_cast<const char *>(src),
+                                 static_cast<char *>(dst), (int)src_size,
+                                 (int)dst_size);
+  return size >= 0 && (size_t)size == dst_size;
+}
+
+static size_t Lz4Compress(const void *src, size_t src_size, void *dst,
+                          size_t dst_capacity) {
+  if (src_size > LZ4_MAX_INPUT_SIZE) {
+    return 0;
+  }
+  int capacity = (int)std::min<size_t>(dst_capacity, INT_MAX);
+  // 0 when the block does not fit
+  return (size_t)LZ4_compress_default(static_cast<const char *>(src),
+                                      static_cast<char *>(dst),
+                                      (int)src_size, capacity);
+}
+
+static bool ZstdDecompress(const void *src, size_t src_size, void *dst,
+                           size_t dst_size) {
+  struct ContextDeleter {
+    void operator()(ZSTD_DCtx *context) const { ZSTD_freeDCtx(context); }
+  };
+  thread_local std::unique_ptr<ZSTD_DCtx, ContextDeleter> context(
+      ZSTD_createDCtx());
+  if (!context) {
+    return false;
+  }
+  size_t size =
+      ZSTD_decompressDCtx(context.get(), dst, dst_size, src, src_size);
+  return !ZSTD_isError(size) && size == dst_size;
+}
+
+// matches the zstd command line default
+static constexpr int ZSTD_LEVEL = 3;
+
+static size_t ZstdCompress(const void *src, size_t src_size, void *dst,
+                           size_t dst_capacity) {
+  struct ContextDeleter {
+    void operator()(ZSTD_CCtx *context) const { ZSTD_freeCCtx(context); }
+  };
+  thread_local std::unique_ptr<ZSTD_CCtx, ContextDeleter> context(
+      ZSTD_createCCtx());
+  if (!context) {
+    return 0;
+  }
+  size_t size = ZSTD_compressCCtx(context.get(), dst, dst_capacity, src,
+                                  src_size, ZSTD_LEVEL);
+  return ZSTD_isError(size) ? 0 : size;
+}
+
+bool BlockCodec::IsValid(const CompressedHeader &header) {
+  if (header.magic != MAGIC || header.block_size == 0 ||
+      (header.codec != CompressionCodec::Lz4 &&
+       header.codec != CompressionCodec::Zstd)) {
+    return false;
+  }
+  return header.block_count ==
+         (header.raw_size + header.block_size - 1) / header.block_size;
+}
+
+size_t BlockCodec::CompressBound(CompressionCodec codec, size_t size) {
+  switch (codec) {
+  case CompressionCodec::Lz4:
+    // blocks too large for LZ4 are stored
+    return size <= LZ4_MAX_INPUT_SIZE ? LZ4_COMPRESSBOUND(size) : size;
+  case CompressionCodec::Zstd:
+    return ZSTD_compressBound(size);
+  }
+  return size;
+}
+
+size_t BlockCodec::CompressBlock(CompressionCodec codec, const void *src,
+                                 size_t src_size, void *dst,
+                                 size_t dst_capacity) {
+  switch (codec) {
+  case CompressionCodec::Lz4:
+    return Lz4Compress(src, src_size, dst, dst_capacity);
+  case CompressionCodec::Zstd:
+    return ZstdCompress(src, src_size, dst, dst_capacity);
+  }
+  return 0;
+}
+
+bool BlockCodec::DecompressBlock(CompressionCodec codec, const void *src,
+                                 size_t src_size, void *dst,
+                                 size_t dst_size) {
+  switch (codec) {
+  case CompressionCodec::Lz4:
+    return Lz4Decompress(src, src_size, dst, dst_size);
+  case CompressionCodec::Zstd:
+    return ZstdDecompress(src, src_size, dst, dst_size);
+  }
+  return false;
+}
+
+size_t BlockCodec::PayloadBound(CompressionCodec codec, uint64_t size) {
+  auto header = MakeHeader(codec, size);
+  return sizeof(header) + TableSize(header) +
+         header.block_count * CompressBound(codec, header.block_size);
+}
+
+// The blocks are first encoded into slots of CompressBound bytes behind the
+// table, so that they can be encoded in any order, then moved together.
+void BlockCodec::EncodeBlock(CompressionCodec codec, const void *src,
+                             uint64_t size, size_t index, void *dst) {
+  auto header = MakeHeader(codec, size);
+  size_t bound = CompressBound(codec, header.block_size);
+  auto *payload = static_cast<uint8_t *>(dst);
+  uint8_t *slot =
+      payload + sizeof(header) + TableSize(header) + index * bound;
+  const uint8_t *block =
+      static_cast<const uint8_t *>(src) + index * header.block_size;
+  size_t raw_size = RawBlockSize(header, index);
+  size_t block_size = CompressBlock(codec, block, raw_size, slot, bound);
+  uint32_t table_value = (uint32_t)block_size;
+  if (!block_size || block_size >= raw_size) {
+    std::memcpy(slot, block, raw_size);
+    table_value = (uint32_t)raw_size | STORED_BLOCK;
+  }
+  std::memcpy(payload + sizeof(header) + index * sizeof(uint32_t),
+              &table_value, sizeof(table_value));
+}
+
+size_t BlockCodec::FinishPayload(CompressionCodec codec, uint64_t size,
+                                 void *dst) {
+  auto header = MakeHeader(codec, size);
+  size_t bound = CompressBound(codec, header.block_size);
+  auto *payload = static_cast<uint8_t *>(dst);
+  std::memcpy(payload, &header, sizeof(header));
+  size_t prefix = sizeof(header) + TableSize(header);
+  size_t end = prefix;
+  for (size_t i = 0; i < header.block_count; ++i) {
+    uint32_t table_value;
+    std::memcpy(&table_value, payload + sizeof(header) + i * sizeof(uint32_t),
+                sizeof(table_value));
+    size_t block_size = table_value & ~STORED_BLOCK;
+    // never moves a block forward, the slots only shrink
+    std::memmove(payload + end, payload + prefix + i * bound, block_size);
+    end += block_size;
+  }
+  return end;
+}
+} // namespace John
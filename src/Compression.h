@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace John {
+enum class CompressionCodec : uint32_t {
+  // LZ4 block format
+  Lz4,
+  Zstd,
+};
+
+// Compressed payloads are split into independently compressed blocks so
+// they can be decoded in parallel. Layout, little endian:
+//   CompressedHeader
+//   uint32_t block_sizes[block_count], compressed size of each block, blocks
+//            that did not shrink are stored as is and have STORED_BLOCK set
+//   block data, back to back
+struct CompressedHeader {
+  uint32_t magic;
+  CompressionCodec codec;
+  uint64_t raw_size;
+  // raw size of every block but the last
+  uint32_t block_size;
+  uint32_t block_count;
+};
+static_assert(sizeof(CompressedHeader) == 24);
+
+class BlockCodec {
+  // compresses block index into its slot of PayloadBound layout, or copies
+  // it there if it does not shrink, and fills in its table entry
+  static void EncodeBlock(CompressionCodec codec, const void *src,
+                          uint64_t size, size_t index, void *dst);
+  // writes the header and moves the slots together, returns the size
+  static size_t FinishPayload(CompressionCodec codec, uint64_t size,
+                              void *dst);
+
+public:
+  // "JIOC"
+  static constexpr uint32_t MAGIC = 0x434f494a;
+  static constexpr uint32_t STORED_BLOCK = 1u << 31;
+  // raw block size used by the write path
+  static constexpr uint32_t DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+  static bool IsValid(const CompressedHeader &header);
+  static size_t TableSize(const CompressedHeader &header) {
+    return header.block_count * sizeof(uint32_t);
+  }
+  static size_t RawBlockSize(const CompressedHeader &header, size_t index) {
+    return index + 1 < header.block_count
+               ? header.block_size
+               : header.raw_size - (uint64_t)index * header.block_size;
+  }
+  static CompressedHeader MakeHeader(CompressionCodec codec, uint64_t raw_size,
+                                     uint32_t block_size = DEFAULT_BLOCK_SIZE) {
+    return {MAGIC, codec, raw_size, block_size,
+            (uint32_t)((raw_size + block_size - 1) / block_size)};
+  }
+  // worst case compressed size of size bytes
+  static size_t CompressBound(CompressionCodec codec, size_t size);
+  // Returns the compressed size, 0 if the block does not fit into
+  // dst_capacity. Callers store blocks as is that do not shrink.
+  static size_t CompressBlock(CompressionCodec codec, const void *src,
+                              size_t src_size, void *dst,
+                              size_t dst_capacity);
+  // false unless the block decodes to exactly dst_size bytes
+  static bool DecompressBlock(CompressionCodec codec, const void *src,
+                              size_t src_size, void *dst, size_t dst_size);
+
+  // bytes EncodePayload may use to encode size bytes
+  static size_t PayloadBound(CompressionCodec codec, uint64_t size);
+  // Encodes size bytes of src as a complete payload, header and block table
+  // included, into dst, which holds PayloadBound bytes. Returns the payload
+  // size. for_each(count, task) runs task(index) for every block index and
+  // may compress the blocks in parallel.
+  template <typename TForEach>
+  static size_t EncodePayload(CompressionCodec codec, const void *src,
+                              uint64_t size, void *dst,
+                              const TForEach &for_each) {
+    for_each(MakeHeader(codec, size).block_count, [&](size_t index) {
+      EncodeBlock(codec, src, size, index, dst);
+    });
+    return FinishPayload(codec, size, dst);
+  }
+  static size_t EncodePayload(CompressionCodec codec, const void *src,
+                              uint64_t size, void *dst) {
+    return EncodePayload(codec, src, size, dst,
+                         [](size_t count, const auto &task) {
+                           for (size_t i = 0; i < count; ++i) {
+                             task(i);
+                           }
+                         });
+  }
+};
+} // namespace John
@@ -0,0 +1,492 @@
+#include "FileIO.h"
+#include <algorithm>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <winioctl.h>
+#else
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace John {
+#if defined(_WIN32)
+const native_file FileIO::INVALID_FILE = INVALID_HANDLE_VALUE;
+
+native_file FileIO::Open(const char *path, FileAccess access,
+                         uint32_t flags) {
+  DWORD desired = GENERIC_READ;
+  DWORD disposition = OPEN_EXISTING;
+  if (access == FileAccess::ReadWrite) {
+    desired |= GENERIC_WRITE;
+    bool create = flags & FILE_OPEN_CREATE;
+    bool truncate = flags & FILE_OPEN_TRUNCATE;
+    disposition = create && truncate ? CREATE_ALWAYS
+                  : create           ? OPEN_ALWAYS
+                  : truncate         ? TRUNCATE_EXISTING
+                                     : OPEN_EXISTING;
+  }
+  return CreateFileA(path, desired,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                     nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+}
+FileError FileIO::LastError() {
+  switch (GetLastError()) {
+  case ERROR_SUCCESS:
+    return FileError::None;
+  case ERROR_FILE_NOT_FOUND:
+  case ERROR_PATH_NOT_FOUND:
+    return FileError::NotFound;
+  case ERROR_FILE_EXISTS:
+  case ERROR_ALREADY_EXISTS:
+    return FileError::AlreadyExists;
+  default:
+    return FileError::Other;
+  }
+}
+void FileIO::Close(native_file file) {
+  if (file != INVALID_FILE) {
+    CloseHandle(file);
+  }
+}
+int64_t FileIO::ReadAt(native_file file, void *data, size_t size,
+                       uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    OVERLAPPED overlapped{};
+    uint64_t position = offset + done;
+    overlapped.Offset = (DWORD)position;
+    overlapped.OffsetHigh = (DWORD)(position >> 32);
+    DWORD to_read = (DWORD)std::min<size_t>(size - done, 1u << 30);
+    DWORD read = 0;
+    if (!ReadFile(file, (char *)data + done, to_read, &read, &overlapped)) {
+      if (GetLastError() == ERROR_HANDLE_EOF) {
+        break;
+      }
+      return done ? (int64_t)done : -1;
+    }
+    if (read == 0) {
+      break;
+    }
+    done += read;
+  }
+  return done;
+}
+int64_t FileIO::WriteAt(native_file file, const void *data, size_t size,
+                        uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    OVERLAPPED overlapped{};
+    uint64_t position = offset + done;
+    overlapped.Offset = (DWORD)position;
+    overlapped.OffsetHigh = (DWORD)(position >> 32);
+    DWORD to_write = (DWORD)std::min<size_t>(size - done, 1u << 30);
+    DWORD written = 0;
+    if (!WriteFile(file, (const char *)data + done, to_write, &written,
+                   &overlapped) ||
+        written == 0) {
+      return done ? (int64_t)done : -1;
+    }
+    done += written;
+  }
+  return done;
+}
+bool FileIO::Stat(const char *path, FileMetadata *metadata) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+    *metadata = {};
+    return false;
+  }
+  metadata->exists = true;
+  metadata->is_regular = !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+  metadata->size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  return true;
+}
+bool FileIO::Sync(native_file file, FileSyncMode mode, uint64_t offset,
+                  uint64_t size) {
+  // no finer grained flush on Windows
+  return FlushFileBuffers(file);
+}
+bool FileIO::Allocate(native_file file, uint64_t offset, uint64_t size) {
+  FILE_ALLOCATION_INFO allocation;
+  allocation.AllocationSize.QuadPart = offset + size;
+  if (!SetFileInformationByHandle(file, FileAllocationInfo, &allocation,
+                                  sizeof(allocation))) {
+    return false;
+  }
+  LARGE_INTEGER current;
+  if (!GetFileSizeEx(file, &current)) {
+    return false;
+  }
+  if ((uint64_t)current.QuadPart >= offset + size) {
+    return true;
+  }
+  return Truncate(file, offset + size);
+}
+bool FileIO::Truncate(native_file file, uint64_t size) {
+  FILE_END_OF_FILE_INFO end;
+  end.EndOfFile.QuadPart = size;
+  return SetFileInformationByHandle(file, FileEndOfFileInfo, &end,
+                                    sizeof(end));
+}
+bool FileIO::PunchHole(native_file file, uint64_t offset, uint64_t size) {
+  DWORD returned;
+  // deallocates only on sparse files, zeroes otherwise
+  DeviceIoControl(file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned,
+                  nullptr);
+  FILE_ZERO_DATA_INFORMATION zero;
+  zero.FileOffset.QuadPart = offset;
+  zero.BeyondFinalZero.QuadPart = offset + size;
+  return DeviceIoControl(file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero),
+                         nullptr, 0, &returned, nullptr);
+}
+bool FileIO::Prefetch(native_file file, uint64_t offset, uint64_t size) {
+  return false;
+}
+int64_t FileIO::Size(native_file file) {
+  LARGE_INTEGER size;
+  return GetFileSizeEx(file, &size) ? size.QuadPart : -1;
+}
+bool FileIO::NextDataExtent(native_file file, uint64_t offset,
+                            uint64_t *begin, uint64_t *end) {
+  FILE_ALLOCATED_RANGE_BUFFER query, range;
+  query.FileOffset.QuadPart = offset;
+  query.Length.QuadPart = INT64_MAX - offset;
+  DWORD returned;
+  if (!DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query,
+                       sizeof(query), &range, sizeof(range), &returned,
+                       nullptr) &&
+      GetLastError() != ERROR_MORE_DATA) {
+    *begin = offset;
+    *end = UINT64_MAX;
+    return true;
+  }
+  if (returned < sizeof(range)) {
+    return false;
+  }
+  *begin = std::max<uint64_t>(offset, range.FileOffset.QuadPart);
+  *end = range.FileOffset.QuadPart + range.Length.QuadPart;
+  return true;
+}
+bool FileIO::Unlink(const char *path) { return DeleteFileA(path); }
+bool FileIO::Rename(const char *from, const char *to) {
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+}
+bool FileIO::MakeDirectory(const char *path) {
+  return CreateDirectoryA(path, nullptr);
+}
+#else
+const native_file FileIO::INVALID_FILE = -1;
+
+static int OpenFlags(FileAccess access, uint32_t flags = 0) {
+  if (access == FileAccess::Read) {
+    return O_RDONLY | O_CLOEXEC;
+  }
+  return O_RDWR | O_CLOEXEC | (flags & FILE_OPEN_CREATE ? O_CREAT : 0) |
+         (flags & FILE_OPEN_TRUNCATE ? O_TRUNC : 0);
+}
+static void ToMetadata(const struct stat &st, FileMetadata *metadata) {
+  metadata->exists = true;
+  metadata->is_regular = S_ISREG(st.st_mode);
+  metadata->size = st.st_size;
+}
+
+native_file FileIO::Open(const char *path, FileAccess access,
+                         uint32_t flags) {
+  int fd;
+  do {
+    fd = open(path, OpenFlags(access, flags), 0666);
+  } while (fd < 0 && errno == EINTR);
+  return fd;
+}
+FileError FileIO::LastError() {
+  switch (errno) {
+  case 0:
+    return FileError::None;
+  case ENOENT:
+  case ENOTDIR:
+    return FileError::NotFound;
+  case EEXIST:
+    return FileError::AlreadyExists;
+  default:
+    return FileError::Other;
+  }
+}
+void FileIO::Close(native_file file) {
+  if (file >= 0) {
+    close(file);
+  }
+}
+int64_t FileIO::ReadAt(native_file file, void *data, size_t size,
+                       uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t read = pread(file, (char *)data + done, size - done, offset + done);
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done ? (int64_t)done : -1;
+    }
+    if (read == 0) {
+      break;
+    }
+    done += read;
+  }
+  return done;
+}
+int64_t FileIO::WriteAt(native_file file, const void *data, size_t size,
+                        uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t written =
+        pwrite(file, (const char *)data + done, size - done, offset + done);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done ? (int64_t)done : -1;
+    }
+    done += written;
+  }
+  return done;
+}
+bool FileIO::Stat(const char *path, FileMetadata *metadata) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    *metadata = {};
+    return false;
+  }
+  ToMetadata(st, metadata);
+  return true;
+}
+bool FileIO::Sync(native_file file, FileSyncMode mode, uint64_t offset,
+                  uint64_t size) {
+  int result;
+  do {
+    switch (mode) {
+#if defined(__linux__)
+    case FileSyncMode::Range:
+      result = sync_file_range(file, offset, size,
+                               SYNC_FILE_RANGE_WAIT_BEFORE |
+                                   SYNC_FILE_RANGE_WRITE |
+                                   SYNC_FILE_RANGE_WAIT_AFTER);
+      break;
+#endif
+#if defined(__APPLE__)
+    case FileSyncMode::Data:
+      result = fsync(file);
+      break;
+#else
+    case FileSyncMode::Data:
+      result = fdatasync(file);
+      break;
+#endif
+    default:
+      result = fsync(file);
+      break;
+    }
+  } while (result != 0 && errno == EINTR);
+  return result == 0;
+}
+bool FileIO::Allocate(native_file file, uint64_t offset, uint64_t size) {
+#if defined(__linux__)
+  int result;
+  do {
+    result = fallocate(file, 0, offset, size);
+  } while (result != 0 && errno == EINTR);
+  if (result == 0 || errno != EOPNOTSUPP) {
+    return result == 0;
+  }
+  // filesystems without extents, posix_fallocate writes zeros instead
+#endif
+#if defined(__APPLE__)
+  fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)(offset + size),
+                    0};
+  if (fcntl(file, F_PREALLOCATE, &store) == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(file, &st) != 0) {
+    return false;
+  }
+  return (uint64_t)st.st_size >= offset + size ||
+         Truncate(file, offset + size);
+#else
+  // returns the error instead of setting errno
+  int error = posix_fallocate(file, offset, size);
+  errno = error;
+  return error == 0;
+#endif
+}
+bool FileIO::Truncate(native_file file, uint64_t size) {
+  int result;
+  do {
+    result = ftruncate(file, size);
+  } while (result != 0 && errno == EINTR);
+  return result == 0;
+}
+bool FileIO::PunchHole(native_file file, uint64_t offset, uint64_t size) {
+#if defined(__linux__)
+  return fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                   size) == 0;
+#elif defined(__APPLE__)
+  fpunchhole_t hole = {0, 0, (off_t)offset, (off_t)size};
+  return fcntl(file, F_PUNCHHOLE, &hole) == 0;
+#else
+  errno = EOPNOTSUPP;
+  return false;
+#endif
+}
+bool FileIO::Prefetch(native_file file, uint64_t offset, uint64_t size) {
+#if defined(__linux__)
+  // unlike POSIX_FADV_WILLNEED the whole range is read before returning
+  return readahead(file, offset, size) == 0;
+#elif defined(__APPLE__)
+  struct radvisory advice = {(off_t)offset,
+                             (int)std::min<uint64_t>(size, INT_MAX)};
+  return fcntl(file, F_RDADVISE, &advice) != -1;
+#else
+  return posix_fadvise(file, offset, size, POSIX_FADV_WILLNEED) == 0;
+#endif
+}
+int64_t FileIO::Size(native_file file) {
+  struct stat st;
+  return fstat(file, &st) == 0 ? st.st_size : -1;
+}
+bool FileIO::NextDataExtent(native_file file, uint64_t offset,
+                            uint64_t *begin, uint64_t *end) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t data = lseek(file, offset, SEEK_DATA);
+  if (data < 0) {
+    if (errno == ENXIO) {
+      return false;
+    }
+  } else {
+    off_t hole = lseek(file, data, SEEK_HOLE);
+    if (hole >= 0) {
+      *begin = data;
+      *end = hole;
+      return true;
+    }
+  }
+#endif
+  *begin = offset;
+  *end = UINT64_MAX;
+  return true;
+}
+bool FileIO::Unlink(const char *path) { return unlink(path) == 0; }
+bool FileIO::Rename(const char *from, const char *to) {
+  return rename(from, to) == 0;
+}
+bool FileIO::MakeDirectory(const char *path) { return mkdir(path, 0777) == 0; }
+native_file FileIO::OpenDirectory(const char *path) {
+#if defined(O_PATH)
+  return open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+  return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+}
+native_file FileIO::OpenAt(native_file dir, const char *name,
+                           FileAccess access) {
+  int fd;
+  do {
+    fd = openat(dir, name, OpenFlags(access));
+  } while (fd < 0 && errno == EINTR);
+  return fd;
+}
+bool FileIO::StatAt(native_file dir, const char *name,
+                    FileMetadata *metadata) {
+  struct stat st;
+  if (fstatat(dir, name, &st, 0) != 0) {
+    *metadata = {};
+    return false;
+  }
+  ToMetadata(st, metadata);
+  return true;
+}
+#endif
+
+FileCache &FileCache::Get() {
+  static FileCache cache;
+  return cache;
+}
+
+OpenFilePtr FileCache::Find(file_handle handle, FileAccess access) {
+  if (handle.index >= entries.size()) {
+    return nullptr;
+  }
+  auto &entry = entries[handle.index];
+  if (entry.generation != handle.generation) {
+    return nullptr;
+  }
+  return entry.files[(size_t)access];
+}
+
+OpenFilePtr FileCache::Acquire(file_handle handle, FileAccess access,
+                               uint32_t flags) {
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (auto file = Find(handle, access)) {
+      return file;
+    }
+  }
+  auto *path = PathTable::Get().Path(handle);
+  if (!path) {
+    return nullptr;
+  }
+  native_file file = FileIO::Open(path, access, flags);
+  if (file == FileIO::INVALID_FILE) {
+    return nullptr;
+  }
+  return Insert(handle, access, file);
+}
+
+OpenFilePtr FileCache::Insert(file_handle handle, FileAccess access,
+                              native_file file) {
+  auto opened = std::make_shared<OpenFile>(file);
+  std::lock_guard<std::mutex> lk(mutex);
+  // another thread may have opened it meanwhile, keep the cached one
+  if (auto cached = Find(handle, access)) {
+    return cached;
+  }
+  if (handle.index >= entries.size()) {
+    entries.resize(handle.index + 1);
+  }
+  auto &entry = entries[handle.index];
+  if (entry.generation != handle.generation) {
+    ForgetOrder(handle.index);
+    entry = {};
+    entry.generation = handle.generation;
+  }
+  entry.files[(size_t)access] = opened;
+  order.emplace_back(handle, access);
+  while (order.size() > MAX_OPEN_FILES) {
+    auto [evicted, evicted_access] = order.front();
+    order.pop_front();
+    auto &evicted_entry = entries[evicted.index];
+    if (evicted_entry.generation == evicted.generation) {
+      evicted_entry.files[(size_t)evicted_access] = nullptr;
+    }
+  }
+  return opened;
+}
+
+void FileCache::Evict(file_handle handle) {
+  std::lock_guard<std::mutex> lk(mutex);
+  if (handle.index < entries.size() &&
+      entries[handle.index].generation == handle.generation) {
+    ForgetOrder(handle.index);
+    entries[handle.index] = {};
+  }
+}
+
+void FileCache::ForgetOrder(uint32_t index) {
+  std::erase_if(order, [&](auto &key) { return key.first.index == index; });
+}
+} // namespace John
@@ -0,0 +1,120 @@
+#pragma once
+#include "PathTable.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace John {
+#if defined(_WIN32)
+using native_file = void *;
+#else
+using native_file = int;
+#endif
+enum class FileAccess : uint32_t {
+  Read,
+  ReadWrite,
+};
+// only meaningful with FileAccess::ReadWrite
+enum FileOpenFlags : uint32_t {
+  FILE_OPEN_CREATE = 1 << 0,
+  FILE_OPEN_TRUNCATE = 1 << 1,
+};
+enum class FileSyncMode : uint32_t {
+  // data and metadata
+  Full,
+  // data and the metadata needed to read it back
+  Data,
+  // writeback of a byte range only, no durability guarantee
+  Range,
+};
+enum class FileError : uint32_t {
+  None,
+  NotFound,
+  AlreadyExists,
+  Other,
+};
+
+// Thin positional I/O layer over the platform file API.
+struct FileIO {
+  static const native_file INVALID_FILE;
+  static native_file Open(const char *path, FileAccess access,
+                          uint32_t flags = 0);
+  static void Close(native_file file);
+  // error of the last failed call on this thread
+  static FileError LastError();
+  // Loops until size bytes are transferred, the end of file is reached or an
+  // error occurs. Returns the bytes transferred, or -1 if nothing could be.
+  static int64_t ReadAt(native_file file, void *data, size_t size,
+                        uint64_t offset);
+  static int64_t WriteAt(native_file file, const void *data, size_t size,
+                         uint64_t offset);
+  static bool Sync(native_file file, FileSyncMode mode, uint64_t offset = 0,
+                   uint64_t size = 0);
+  // reserves blocks for the range, extending the file if it ends earlier
+  static bool Allocate(native_file file, uint64_t offset, uint64_t size);
+  static bool Truncate(native_file file, uint64_t size);
+  // deallocates the range, reads return zeros, the file size is unchanged
+  static bool PunchHole(native_file file, uint64_t offset, uint64_t size);
+  // Starts reading the range into the page cache without copying it out,
+  // false where the platform has no such hint
+  static bool Prefetch(native_file file, uint64_t offset, uint64_t size);
+  // -1 on failure
+  static int64_t Size(native_file file);
+  // Finds the first data extent at or after offset, false if only a hole
+  // follows. Without hole support the rest of the file is one extent.
+  static bool NextDataExtent(native_file file, uint64_t offset,
+                             uint64_t *begin, uint64_t *end);
+  static bool Stat(const char *path, FileMetadata *metadata);
+  static bool Unlink(const char *path);
+  // replaces an existing destination
+  static bool Rename(const char *from, const char *to);
+  static bool MakeDirectory(const char *path);
+#if !defined(_WIN32)
+  // directory relative variants for resolving many files below few parents
+  static native_file OpenDirectory(const char *path);
+  static native_file OpenAt(native_file dir, const char *name,
+                            FileAccess access);
+  static bool StatAt(native_file dir, const char *name,
+                     FileMetadata *metadata);
+#endif
+};
+
+// An open descriptor, closed once the last user releases it.
+struct OpenFile {
+  native_file file;
+  explicit OpenFile(native_file file) : file(file) {}
+  OpenFile(const OpenFile &) = delete;
+  OpenFile &operator=(const OpenFile &) = delete;
+  ~OpenFile() { FileIO::Close(file); }
+};
+using OpenFilePtr = std::shared_ptr<OpenFile>;
+
+// Open descriptors keyed by interned path. Eviction only drops the cache's
+// reference, commands holding the descriptor keep it open until they finish.
+class FileCache {
+  struct Entry {
+    uint32_t generation = 0;
+    OpenFilePtr files[2];
+  };
+  std::mutex mutex;
+  std::vector<Entry> entries;
+  // insertion order of cached descriptors, oldest evicted first
+  std::deque<std::pair<file_handle, FileAccess>> order;
+
+  OpenFilePtr Find(file_handle handle, FileAccess access);
+  // drops the order keys of every generation of the path
+  void ForgetOrder(uint32_t index);
+
+public:
+  static constexpr size_t MAX_OPEN_FILES = 512;
+  static FileCache &Get();
+  // opens on a miss, null if the handle is stale or the file can't be opened
+  OpenFilePtr Acquire(file_handle handle, FileAccess access,
+                      uint32_t flags = 0);
+  OpenFilePtr Insert(file_handle handle, FileAccess access, native_file file);
+  void Evict(file_handle handle);
+};
+} // namespace John
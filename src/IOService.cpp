@@ -1,14 +1,454 @@
 #include "IOService.h"
+#include "BlockCache.h"
+#include "FileIO.h"
+#include "misc/checksum.h"
+#include "misc/memops.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <latch>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <unordered_map>
 #include <spdlog/spdlog.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 namespace John {
+using Clock = std::chrono::steady_clock;
+using Deadline = Clock::time_point;
+static constexpr size_t IO_CHUNK_SIZE = 1024 * 1024;
+// memory commands larger than this are split across the workers
+static constexpr size_t MEM_CHUNK_SIZE = 8 * 1024 * 1024;
+// read-ahead starts after this many reads continued where the previous ended
+static constexpr uint32_t SEQUENTIAL_READS = 2;
+static constexpr uint64_t MIN_READ_AHEAD = 128 * 1024;
+// files followed at once, the least recently read one is dropped beyond
+static constexpr size_t MAX_READ_AHEAD_STREAMS = 32;
+// block cache hits are only served inline in lists with fewer memory
+// buffers handed to the looper before them
+static constexpr size_t MAX_PENDING_SPANS = 64;
+// larger reads fill the block cache with the blocks they cover completely
+static constexpr size_t MAX_BLOCK_FILL = 256 * 1024;
+// shared reads tracked before finished ones are swept out
+static constexpr size_t MAX_SHARED_READS = 1024;
+
+void Event::OpenNotifyHandle() {
+#if defined(__linux__)
+  if (notify_fd < 0) {
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd < 0) {
+      SPDLOG_ERROR("Failed to create eventfd");
+    }
+  }
+#endif
+}
+void Event::CloseNotifyHandle() {
+#if defined(__linux__)
+  if (notify_fd >= 0) {
+    close(notify_fd);
+    notify_fd = -1;
+  }
+#endif
+}
+void Event::Notify() {
+#if defined(__linux__)
+  if (notify_fd >= 0) {
+    uint64_t one = 1;
+    // a saturated counter is still readable, nothing to handle on failure
+    [[maybe_unused]] auto written = write(notify_fd, &one, sizeof(one));
+  }
+#endif
+}
+
+struct IOBatch;
+
+// per-command bookkeeping shared between the handler and the looper
+struct IOCmdState {
+  Clock::time_point submit_time;
+  Deadline deadline = Deadline::max();
+  IOResult result;
+  IOResult *user_result = nullptr;
+  IOCmdCallBack callback;
+  uint64_t user_data = 0;
+  IOChecksum checksum = IOChecksum::None;
+  std::optional<uint64_t> expected_checksum;
+  // block cache epoch of the file when the read was submitted, 0 if the
+  // read does not fill the cache
+  uint64_t cache_epoch = 0;
+  // set if later reads may attach to this one
+  std::shared_ptr<struct SharedRead> shared_read;
+  IOBatch *batch = nullptr;
+
+  bool IsExpired(const char *path) const {
+    if (Clock::now() < deadline) {
+      return false;
+    }
+    SPDLOG_WARN("IO command on {} timed out", path);
+    return true;
+  }
+  // runs the callback and posts to the completion queue, IOService thread only
+  void Deliver();
+  void Complete(IOStatus status, size_t bytes) {
+    result.status = status;
+    result.bytes = bytes;
+    result.latency = Clock::now() - submit_time;
+    if (user_result) {
+      *user_result = result;
+    }
+    OnComplete();
+  }
+
+private:
+  void OnComplete();
+};
+
+// commands of out-of-order batches whose callbacks may fire right away
+struct CompletedCmds {
+  std::mutex mutex;
+  std::vector<IOCmdState *> states;
+};
+
+// a submitted command list, alive until its time stamp is signaled
+struct IOBatch {
+  IOCmdStoragePtr storage;
+  std::pmr::vector<IOCmdState> states;
+  uint64_t time_stamp = 0;
+  // set for out-of-order batches only
+  CompletedCmds *completed = nullptr;
+  IOCompletionQueue *queue = nullptr;
+  bool callbacks_fired = false;
+  std::atomic_size_t pending = 0;
+
+  explicit IOBatch(IOCmdStoragePtr &&in_storage)
+      : storage(std::move(in_storage)),
+        states(storage->cmds.size(), &storage->arena) {}
+  bool IsDone() const { return pending.load(std::memory_order_acquire) == 0; }
+  void InvokeCallbacks() {
+    callbacks_fired = true;
+    if (!completed) {
+      for (auto &state : states) {
+        state.Deliver();
+      }
+    }
+    if (storage->callbacks.empty()) {
+      return;
+    }
+    std::pmr::vector<IOResult> results(&storage->arena);
+    results.reserve(states.size());
+    for (auto &state : states) {
+      results.push_back(state.result);
+    }
+    for (auto &callback : storage->callbacks) {
+      callback(results);
+    }
+  }
+};
+
+static constexpr size_t STORAGE_POOL_SIZE = 64;
+// larger arenas are freed instead of pooled
+static constexpr size_t STORAGE_POOL_MAX_CAPACITY = 4 * 1024 * 1024;
+struct IOCmdStoragePool {
+  std::mutex mutex;
+  std::vector<IOCmdStorage *> storages;
+  // never destroyed, lists may be released during static destruction
+  static IOCmdStoragePool &Get() {
+    static auto *pool = new IOCmdStoragePool;
+    return *pool;
+  }
+};
+
+IOCmdStoragePtr IOCmdStorage::Acquire() {
+  auto &pool = IOCmdStoragePool::Get();
+  {
+    std::lock_guard<std::mutex> lk(pool.mutex);
+    if (!pool.storages.empty()) {
+      auto *storage = pool.storages.back();
+      pool.storages.pop_back();
+      return IOCmdStoragePtr(storage);
+    }
+  }
+  return IOCmdStoragePtr(new IOCmdStorage);
+}
+void IOCmdStorage::Recycler::operator()(IOCmdStorage *storage) const {
+  if (storage->arena.Capacity() <= STORAGE_POOL_MAX_CAPACITY) {
+    storage->Reset();
+    auto &pool = IOCmdStoragePool::Get();
+    std::lock_guard<std::mutex> lk(pool.mutex);
+    if (pool.storages.size() < STORAGE_POOL_SIZE) {
+      pool.storages.push_back(storage);
+      return;
+    }
+  }
+  delete storage;
+}
+
+void IOCmdState::Deliver() {
+  if (callback) {
+    callback(result);
+  }
+  if (batch->queue) {
+    batch->queue->Post({user_data, batch->time_stamp, result});
+  }
+}
+
+void IOCmdState::OnComplete() {
+  if (batch->completed && (callback || batch->queue)) {
+    std::lock_guard<std::mutex> lk(batch->completed->mutex);
+    batch->completed->states.push_back(this);
+  }
+  // must be the last access, the batch may be retired right after
+  batch->pending.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+// running hash of the bytes a read command transferred
+class ReadChecksum {
+  IOChecksum type;
+  uint32_t crc = 0;
+  std::optional<Xxh3Stream> xxh3;
+
+public:
+  explicit ReadChecksum(IOChecksum type) : type(type) {
+    if (type == IOChecksum::Xxh3) {
+      xxh3.emplace();
+    }
+  }
+  void Update(const void *data, size_t size) {
+    if (type == IOChecksum::Crc32c) {
+      crc = Crc32c(data, size, crc);
+    } else if (xxh3) {
+      xxh3->Update(data, size);
+    }
+  }
+  uint64_t Digest() const {
+    return type == IOChecksum::Crc32c ? crc : xxh3 ? xxh3->Digest() : 0;
+  }
+};
+
+// sized for the largest request lambda below so none of them allocates
+using IORequest = MoveFunction<void(void), 96>;
+
+// Threads running the pieces of a single large command in parallel. The
+// looper waits for all pieces of a command, so commands of a list still
+// execute in recording order.
+class IOWorkerPool {
+  std::vector<std::jthread> threads;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<IORequest> tasks;
+  bool stopping = false;
+
+  void WorkLoop() {
+    while (true) {
+      IORequest task;
+      {
+        std::unique_lock<std::mutex> lk(mutex);
+        cv.wait(lk, [this]() { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+public:
+  explicit IOWorkerPool(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      threads.emplace_back([this]() { WorkLoop(); });
+    }
+  }
+  ~IOWorkerPool() { Stop(); }
+  // runs the queued tasks before the threads exit
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &thread : threads) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+  void Submit(IORequest &&task) {
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+  }
+};
+
+// A compressed payload staged in memory whose blocks are decoded on the
+// workers, the last block completes the command.
+struct DecodeJob {
+  CompressedHeader header;
+  // block size table followed by the block data
+  std::vector<uint8_t> staging;
+  std::vector<size_t> block_offsets;
+  uint8_t *dst;
+  IOCmdState *state;
+  // only compared, the batch may be retired once the job is done
+  const IOBatch *batch;
+  std::atomic_size_t remaining;
+  std::atomic<IOStatus> status = IOStatus::Success;
+  std::atomic_bool done = false;
+
+  void Decode(size_t index) {
+    if (status.load(std::memory_order_relaxed) == IOStatus::Success) {
+      uint32_t block = reinterpret_cast<const uint32_t *>(staging.data())[index];
+      size_t block_size = block & ~BlockCodec::STORED_BLOCK;
+      size_t raw_size = BlockCodec::RawBlockSize(header, index);
+      const uint8_t *src = staging.data() + block_offsets[index];
+      uint8_t *out = dst + index * (size_t)header.block_size;
+      bool succeeded;
+      if (block & BlockCodec::STORED_BLOCK) {
+        succeeded = block_size == raw_size;
+        if (succeeded) {
+          std::memcpy(out, src, raw_size);
+        }
+      } else {
+        succeeded = BlockCodec::DecompressBlock(header.codec, src, block_size,
+                                                out, raw_size);
+      }
+      if (!succeeded) {
+        status = IOStatus::CorruptData;
+      }
+    }
+    if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      IOStatus result = status;
+      if (result != IOStatus::Success) {
+        SPDLOG_ERROR("Corrupt compressed block");
+      }
+      state->Complete(result,
+                      result == IOStatus::Success ? header.raw_size : 0);
+      done.store(true, std::memory_order_release);
+      done.notify_all();
+    }
+  }
+};
+
+// A read into memory on the looper that later reads of a range it contains
+// attach to instead of reading again. The leader copies its data to them
+// before it completes itself.
+struct SharedRead {
+  struct Follower {
+    uint64_t offset;
+    std::span<uint8_t> data;
+    IOCmdState *state;
+  };
+  file_handle handle;
+  uint64_t offset;
+  std::span<uint8_t> data;
+  std::mutex mutex;
+  std::atomic_bool finished = false;
+  std::vector<Follower> followers;
+
+  SharedRead(file_handle handle, uint64_t offset, std::span<uint8_t> data)
+      : handle(handle), offset(offset), data(data) {}
+  bool Contains(uint64_t begin, size_t size) const {
+    return begin >= offset && begin + size <= offset + data.size();
+  }
+  bool IsFinished() const { return finished.load(std::memory_order_acquire); }
+  // false once the leader finished
+  bool Attach(const Follower &follower) {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (IsFinished()) {
+      return false;
+    }
+    followers.push_back(follower);
+    return true;
+  }
+  // the followers to complete, none can attach afterwards
+  std::vector<Follower> Finish() {
+    std::lock_guard<std::mutex> lk(mutex);
+    finished.store(true, std::memory_order_release);
+    return std::move(followers);
+  }
+};
+
+// A range read ahead on a worker, written once before ready is set.
+struct ReadAheadBuffer {
+  uint64_t offset;
+  std::vector<uint8_t> data;
+  // bytes read, less than requested at the end of the file
+  size_t size = 0;
+  std::atomic_bool ready = false;
+  // at least one read was served from it
+  bool used = false;
+
+  uint64_t End() const { return offset + data.size(); }
+  void Wait() const {
+    while (!ready.load(std::memory_order_acquire)) {
+      ready.wait(false, std::memory_order_acquire);
+    }
+  }
+};
+
+// A file read front to back. Up to window bytes past the last read are kept
+// in flight in buffers of half the window. The window doubles whenever a
+// buffer was consumed completely and halves whenever read-ahead data is
+// dropped without being used.
+struct SequentialStream {
+  file_handle handle;
+  // end of the last read
+  uint64_t next_offset = 0;
+  uint32_t sequential_reads = 0;
+  uint64_t window = 0;
+  uint64_t last_read = 0;
+  std::deque<std::shared_ptr<ReadAheadBuffer>> buffers;
+
+  // returns true if read-ahead data was dropped unused
+  bool Drop() {
+    bool wasted = false;
+    for (auto &buffer : buffers) {
+      wasted = wasted || !buffer->used;
+    }
+    buffers.clear();
+    return wasted;
+  }
+};
 
 class IOLooper {
+  struct LooperRequest {
+    IORequest run;
+    // list the request belongs to, null for backend housekeeping
+    const IOBatch *batch;
+  };
+  // Full and Data flushes of one file held back by group commit
+  struct DeferredFlush {
+    file_handle handle;
+    OpenFilePtr file;
+    FileSyncMode mode;
+    std::vector<IOCmdState *> waiters;
+  };
   std::jthread thread;
   std::mutex mutex;
-  std::vector<std::function<void(void)>> requests;
-  bool enabled = true;
+  // wakes the looper while it waits for the group commit window
+  std::condition_variable wakeup;
+  std::vector<LooperRequest> requests;
+  std::atomic_bool enabled = true;
+  IOWorkerPool workers{std::clamp(std::thread::hardware_concurrency(), 2u, 8u)};
+  // file to file copies larger than this are split across the workers
+  std::atomic_size_t copy_chunk_size = 16 * 1024 * 1024;
+  // negative when group commit is disabled
+  std::atomic_int64_t group_commit_window_us = -1;
+  // largest read-ahead window, 0 disables read-ahead
+  std::atomic_uint64_t max_read_ahead = 4 * 1024 * 1024;
+  // keyed by path index, looper thread only
+  std::unordered_map<uint32_t, SequentialStream> streams;
+  uint64_t stream_reads = 0;
+  // payloads being decoded on the workers, looper thread only
+  std::vector<std::shared_ptr<DecodeJob>> decoding;
+  // looper thread only
+  std::vector<DeferredFlush> deferred_flushes;
+  Clock::time_point first_deferred;
 
 public:
   IOLooper() {
@@ -17,23 +457,72 @@ public:
   ~IOLooper() {}
 
   static void Init() { IOLooper::Get(); }
-  static void Dispose() { IOLooper::Get().enabled = false; }
+  static void Dispose() {
+    {
+      std::lock_guard<std::mutex> lk(IOLooper::Get().mutex);
+      IOLooper::Get().enabled = false;
+    }
+    IOLooper::Get().wakeup.notify_one();
+    if (IOLooper::Get().thread.joinable()) {
+      IOLooper::Get().thread.join();
+    }
+    IOLooper::Get().workers.Stop();
+  }
   static void EnqueueRequest(file_handle handle, size_t file_offset, void *ptr,
-                             size_t len) {
-    IOLooper::Get()._EnqueueRequest(handle, file_offset, ptr, len);
+                             size_t len, IOCmdState *state) {
+    IOLooper::Get()._EnqueueRequest(handle, file_offset, ptr, len, state);
   }
   static void EnqueueRequest(const void *ptr, size_t len, file_handle handle,
-                             size_t file_offset) {
-    IOLooper::Get()._EnqueueRequest(ptr, len, handle, file_offset);
-  }
-  static void EnqueueSignal(Event *event_handle, uint64_t timeline) {
-    IOLooper::Get()._EnqueueSignal(event_handle, timeline);
+                             size_t file_offset, IOCmdState *state) {
+    IOLooper::Get()._EnqueueRequest(ptr, len, handle, file_offset, state);
   }
   static void EnqueueRequest(file_handle handle, size_t offset, size_t src_size,
                              file_handle dst_handle, size_t dst_offset,
-                             size_t dst_size) {
+                             size_t dst_size, IOCmdState *state) {
     IOLooper::Get()._EnqueueRequest(handle, offset, src_size, dst_handle,
-                                    dst_offset, dst_size);
+                                    dst_offset, dst_size, state);
+  }
+  static void EnqueueMetaRequest(const IOCmd &cmd, IOCmdState *state) {
+    IOLooper::Get()._EnqueueMetaRequest(
+        cmd.type, std::get<FileDesc>(cmd.src).handle,
+        std::get<FileDesc>(cmd.dst).handle, cmd.flags, cmd.metadata, state);
+  }
+  static void EnqueuePrefetch(std::vector<file_handle> &&handles) {
+    IOLooper::Get()._EnqueuePrefetch(std::move(handles));
+  }
+  static void EnqueueFlush(const FileDesc &range, IOFlushMode mode,
+                           IOCmdState *state) {
+    IOLooper::Get()._EnqueueFlush(range, mode, state);
+  }
+  // copies src or fills with pattern if src is null
+  static void EnqueueMemRequest(uint8_t *dst, const uint8_t *src, size_t size,
+                                uint32_t pattern, IOStatus status,
+                                IOCmdState *state) {
+    IOLooper::Get()._EnqueueMemRequest(dst, src, size, pattern, status, state);
+  }
+  static void EnqueueDecompress(const FileDesc &src, const RawDataDesc &dst,
+                                IOCmdState *state) {
+    IOLooper::Get()._EnqueueDecompress(src, dst, state);
+  }
+  static void EnqueueCompress(const RawDataDesc &src, const FileDesc &dst,
+                              CompressionCodec codec, IOCmdState *state) {
+    IOLooper::Get()._EnqueueCompress(src, dst, codec, state);
+  }
+  static void EnqueueSpaceRequest(IOCmdType type, const FileDesc &range,
+                                  IOCmdState *state) {
+    IOLooper::Get()._EnqueueSpaceRequest(type, range, state);
+  }
+  static void SetCopyChunkSize(size_t size) {
+    IOLooper::Get().copy_chunk_size = std::max<size_t>(size, IO_CHUNK_SIZE);
+  }
+  static void
+  SetGroupCommitWindow(std::optional<std::chrono::microseconds> window) {
+    IOLooper::Get().group_commit_window_us =
+        window ? std::max<int64_t>(window->count(), 0) : -1;
+  }
+  static void SetReadAheadLimit(uint64_t size) {
+    IOLooper::Get().max_read_ahead =
+        size ? std::max<uint64_t>(size, MIN_READ_AHEAD) : 0;
   }
 
 private:
@@ -41,118 +530,1039 @@ private:
     static IOLooper looper;
     return looper;
   }
+  template <typename TFunc> void Push(const IOBatch *batch, TFunc &&func) {
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      requests.push_back({std::forward<TFunc>(func), batch});
+    }
+    wakeup.notify_one();
+  }
   void _EnqueueRequest(file_handle handle, size_t file_offset, void *ptr,
-                       size_t len) {
-    std::lock_guard<std::mutex> lk(mutex);
-    requests.push_back([=]() {
-      auto result_handle = std::fopen((const char *)handle.file, "r");
-      if (!result_handle) {
-        SPDLOG_ERROR("Failed to open file {}", (const char *)handle.file);
-        return;
-      }
-      std::fseek(result_handle, file_offset, SEEK_SET);
-      std::fread(ptr, sizeof(std::byte), len, result_handle);
-      std::fclose(result_handle);
+                       size_t len, IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      ReadToMemory(handle, file_offset, ptr, len, state);
     });
   }
+  // the body of a read into memory, on the looper thread
+  void ReadToMemory(file_handle handle, size_t file_offset, void *ptr,
+                    size_t len, IOCmdState *state) {
+    auto *path = PathTable::Get().Path(handle);
+    if (!path) {
+      CompleteRead(state, IOStatus::InvalidHandle, 0);
+      return;
+    }
+    if (state->IsExpired(path)) {
+      CompleteRead(state, IOStatus::Timeout, 0);
+      return;
+    }
+    auto file = FileCache::Get().Acquire(handle, FileAccess::Read);
+    if (!file) {
+      SPDLOG_ERROR("Failed to open file {}", path);
+      CompleteRead(state, IOStatus::OpenFailed, 0);
+      return;
+    }
+    ReadChecksum checksum(state->checksum);
+    size_t done = ReadFromReadAhead(handle, file_offset, ptr, len);
+    IOStatus status = IOStatus::Success;
+    bool cached = false;
+    if (state->cache_epoch && len - done <= MAX_BLOCK_FILL) {
+      cached = true;
+      status = ReadBlocks(file->file, handle, state->cache_epoch,
+                          file_offset + done, (uint8_t *)ptr + done,
+                          len - done, &done);
+    }
+    checksum.Update(ptr, done);
+    // chunked so that a deadline can be honoured between chunks
+    while (status == IOStatus::Success && done < len) {
+      if (state->IsExpired(path)) {
+        status = IOStatus::Timeout;
+        break;
+      }
+      size_t to_read = std::min(IO_CHUNK_SIZE, len - done);
+      int64_t read = FileIO::ReadAt(file->file, (std::byte *)ptr + done,
+                                    to_read, file_offset + done);
+      if (read < 0) {
+        status = IOStatus::Failed;
+        break;
+      }
+      checksum.Update((std::byte *)ptr + done, read);
+      done += read;
+      if ((size_t)read < to_read) {
+        status = IOStatus::ShortTransfer;
+        break;
+      }
+    }
+    if (status == IOStatus::Success) {
+      TrackRead(handle, file, file_offset, len);
+    }
+    status = FinishChecksum(state, checksum, status, path);
+    if (state->cache_epoch && !cached &&
+        (status == IOStatus::Success || status == IOStatus::ShortTransfer)) {
+      BlockCache::Get().Insert(handle, state->cache_epoch, file_offset, ptr,
+                               done, status == IOStatus::ShortTransfer);
+    }
+    CompleteRead(state, status, done);
+  }
+  // Completes the attached reads first, the leader's buffer may be reused
+  // once it completed. A leader that read nothing usable does not pass its
+  // error on, its followers are read again on their own right away.
+  void CompleteRead(IOCmdState *state, IOStatus status, size_t done) {
+    if (state->shared_read) {
+      auto &read = *state->shared_read;
+      bool has_data = status == IOStatus::Success ||
+                      status == IOStatus::ShortTransfer ||
+                      status == IOStatus::ChecksumMismatch;
+      for (auto &follower : read.Finish()) {
+        if (!has_data) {
+          ReadToMemory(read.handle, follower.offset, follower.data.data(),
+                       follower.data.size(), follower.state);
+          continue;
+        }
+        uint64_t skip = follower.offset - read.offset;
+        size_t copied =
+            done > skip ? std::min<uint64_t>(follower.data.size(), done - skip)
+                        : 0;
+        std::memmove(follower.data.data(), read.data.data() + skip, copied);
+        ReadChecksum checksum(follower.state->checksum);
+        checksum.Update(follower.data.data(), copied);
+        auto *path = PathTable::Get().Path(read.handle);
+        IOStatus follower_status = FinishChecksum(
+            follower.state, checksum,
+            copied < follower.data.size() ? IOStatus::ShortTransfer
+                                          : IOStatus::Success,
+            path ? path : "");
+        follower.state->Complete(follower_status, copied);
+      }
+    }
+    state->Complete(status, done);
+  }
+  // Small reads fill the block cache with the whole blocks around them, so
+  // that later reads of neighbouring bytes hit. done is advanced by the
+  // bytes copied to ptr.
+  static IOStatus ReadBlocks(native_file file, file_handle handle,
+                             uint64_t epoch, uint64_t offset, uint8_t *ptr,
+                             size_t len, size_t *done) {
+    constexpr uint64_t block_size = BlockCache::BLOCK_SIZE;
+    uint64_t begin = offset / block_size * block_size;
+    uint64_t end = (offset + len + block_size - 1) / block_size * block_size;
+    thread_local std::vector<uint8_t> blocks;
+    blocks.resize(end - begin);
+    int64_t read = FileIO::ReadAt(file, blocks.data(), blocks.size(), begin);
+    if (read < 0) {
+      return IOStatus::Failed;
+    }
+    BlockCache::Get().Insert(handle, epoch, begin, blocks.data(), read,
+                             (uint64_t)read < blocks.size());
+    size_t copied = (uint64_t)read > offset - begin
+                        ? std::min<uint64_t>(len, read - (offset - begin))
+                        : 0;
+    std::memcpy(ptr, blocks.data() + (offset - begin), copied);
+    *done += copied;
+    return copied < len ? IOStatus::ShortTransfer : IOStatus::Success;
+  }
+  // copies the leading part of the range that was read ahead, returns the
+  // bytes copied
+  size_t ReadFromReadAhead(file_handle handle, uint64_t offset, void *ptr,
+                           size_t len) {
+    auto iter = streams.find(handle.index);
+    if (iter == streams.end() || iter->second.handle != handle) {
+      return 0;
+    }
+    auto &stream = iter->second;
+    size_t done = 0;
+    while (done < len && !stream.buffers.empty()) {
+      auto &buffer = *stream.buffers.front();
+      uint64_t pos = offset + done;
+      if (pos < buffer.offset || pos >= buffer.End()) {
+        break;
+      }
+      buffer.Wait();
+      buffer.used = true;
+      if (pos >= buffer.offset + buffer.size) {
+        break;
+      }
+      size_t size = std::min<uint64_t>(len - done,
+                                       buffer.offset + buffer.size - pos);
+      std::memcpy((uint8_t *)ptr + done,
+                  buffer.data.data() + (pos - buffer.offset), size);
+      done += size;
+      if (pos + size < buffer.End()) {
+        break;
+      }
+      stream.window = std::min<uint64_t>(stream.window * 2, max_read_ahead);
+      stream.buffers.pop_front();
+    }
+    return done;
+  }
+  // follows reads of the file and keeps reading ahead of sequential ones
+  void TrackRead(file_handle handle, const OpenFilePtr &file, uint64_t offset,
+                 size_t len) {
+    uint64_t limit = max_read_ahead;
+    if (!limit || !len) {
+      return;
+    }
+    auto &stream = streams[handle.index];
+    if (stream.handle != handle) {
+      stream.Drop();
+      stream = {handle};
+    }
+    stream.last_read = ++stream_reads;
+    if (offset == stream.next_offset) {
+      ++stream.sequential_reads;
+    } else {
+      stream.sequential_reads = 0;
+      if (stream.Drop()) {
+        stream.window = std::max(stream.window / 2, MIN_READ_AHEAD);
+      }
+    }
+    stream.next_offset = offset + len;
+    if (stream.sequential_reads < SEQUENTIAL_READS) {
+      if (streams.size() > MAX_READ_AHEAD_STREAMS) {
+        DropOldestStream();
+      }
+      return;
+    }
+    if (!stream.window) {
+      stream.window = std::clamp<uint64_t>(4 * len, MIN_READ_AHEAD, limit);
+    }
+    stream.window = std::min(stream.window, limit);
+    uint64_t ahead_end = stream.buffers.empty()
+                             ? stream.next_offset
+                             : stream.buffers.back()->End();
+    int64_t file_size = ahead_end - stream.next_offset < stream.window
+                            ? FileIO::Size(file->file)
+                            : 0;
+    uint64_t piece = stream.window / 2;
+    while (ahead_end - stream.next_offset < stream.window &&
+           (int64_t)ahead_end < file_size) {
+      auto buffer = std::make_shared<ReadAheadBuffer>();
+      buffer->offset = ahead_end;
+      buffer->data.resize(std::min<uint64_t>(piece, file_size - ahead_end));
+      workers.Submit([buffer, file]() {
+        int64_t read = FileIO::ReadAt(file->file, buffer->data.data(),
+                                      buffer->data.size(), buffer->offset);
+        buffer->size = std::max<int64_t>(read, 0);
+        buffer->ready.store(true, std::memory_order_release);
+        buffer->ready.notify_all();
+      });
+      ahead_end = buffer->End();
+      stream.buffers.push_back(std::move(buffer));
+    }
+    if (streams.size() > MAX_READ_AHEAD_STREAMS) {
+      DropOldestStream();
+    }
+  }
+  void DropOldestStream() {
+    auto oldest = std::min_element(
+        streams.begin(), streams.end(), [](auto &lhs, auto &rhs) {
+          return lhs.second.last_read < rhs.second.last_read;
+        });
+    streams.erase(oldest);
+  }
+  // writes and metadata changes make the read-ahead data of a file stale
+  void DropReadAhead(file_handle handle) {
+    if (!streams.empty()) {
+      streams.erase(handle.index);
+    }
+  }
 
   void _EnqueueRequest(const void *ptr, size_t len, file_handle handle,
-                       size_t file_offset) {
-    std::lock_guard<std::mutex> lk(mutex);
-    requests.push_back([=]() {
-      auto result_handle = std::fopen((const char *)handle.file, "r+");
-      if (!result_handle) {
-        SPDLOG_ERROR("Failed to open file {}", (const char *)handle.file);
+                       size_t file_offset, IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      auto *path = PathTable::Get().Path(handle);
+      if (!path) {
+        state->Complete(IOStatus::InvalidHandle, 0);
+        return;
+      }
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      auto file = FileCache::Get().Acquire(handle, FileAccess::ReadWrite);
+      if (!file) {
+        SPDLOG_ERROR("Failed to open file {}", path);
+        state->Complete(IOStatus::OpenFailed, 0);
         return;
       }
-      std::fseek(result_handle, file_offset, SEEK_SET);
-      std::fwrite(ptr, sizeof(std::byte), len, result_handle);
-      std::fclose(result_handle);
+      DropReadAhead(handle);
+      size_t done = 0;
+      IOStatus status = IOStatus::Success;
+      while (done < len) {
+        if (state->IsExpired(path)) {
+          status = IOStatus::Timeout;
+          break;
+        }
+        size_t to_write = std::min(IO_CHUNK_SIZE, len - done);
+        int64_t written =
+            FileIO::WriteAt(file->file, (const std::byte *)ptr + done,
+                            to_write, file_offset + done);
+        if (written < 0) {
+          status = IOStatus::Failed;
+          break;
+        }
+        done += written;
+        if ((size_t)written < to_write) {
+          status = IOStatus::ShortTransfer;
+          break;
+        }
+      }
+      state->Complete(status, done);
     });
   }
 
   void _EnqueueRequest(file_handle handle, size_t offset, size_t src_size,
                        file_handle in_dst_handle, size_t dst_offset,
-                       size_t dst_size) {
-    std::lock_guard<std::mutex> lk(mutex);
-    requests.push_back([=]() {
-      auto src_handle = std::fopen((const char *)handle.file, "r");
-      auto dst_handle = std::fopen((const char *)in_dst_handle.file, "r+");
-      if (!src_handle || !dst_handle) {
-        SPDLOG_ERROR("Failed to open file {}", (const char *)handle.file);
-        return;
-      }
-      std::fseek(src_handle, offset, SEEK_SET);
-      std::fseek(dst_handle, dst_offset, SEEK_SET);
-      // use fixed size buffer for now
-      char buffer[4096];
-      size_t read_size = 0;
-      while (read_size < src_size) {
-        size_t to_read = std::min(sizeof(buffer), src_size - read_size);
-        size_t read = std::fread(buffer, 1, to_read, src_handle);
-        if (read == 0) {
+                       size_t dst_size, IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      auto *path = PathTable::Get().Path(handle);
+      auto *dst_path = PathTable::Get().Path(in_dst_handle);
+      if (!path || !dst_path) {
+        state->Complete(IOStatus::InvalidHandle, 0);
+        return;
+      }
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      auto src_file = FileCache::Get().Acquire(handle, FileAccess::Read);
+      auto dst_file =
+          FileCache::Get().Acquire(in_dst_handle, FileAccess::ReadWrite);
+      if (!src_file || !dst_file) {
+        SPDLOG_ERROR("Failed to open file {}", src_file ? dst_path : path);
+        state->Complete(IOStatus::OpenFailed, 0);
+        return;
+      }
+      DropReadAhead(in_dst_handle);
+      int64_t src_file_size = FileIO::Size(src_file->file);
+      if (src_file_size < 0) {
+        state->Complete(IOStatus::Failed, 0);
+        return;
+      }
+      // Only data extents of the source are copied, holes are punched into
+      // the destination so that sparse files stay sparse. A smaller
+      // destination range bounds the copy.
+      uint64_t end = std::min<uint64_t>(
+          offset + std::min(src_size, dst_size), src_file_size);
+      uint64_t chunk_size = copy_chunk_size;
+      std::vector<CopyChunk> chunks;
+      uint64_t pos = offset;
+      IOStatus status = IOStatus::Success;
+      while (pos < end) {
+        uint64_t data_begin, data_end;
+        if (!FileIO::NextDataExtent(src_file->file, pos, &data_begin,
+                                    &data_end)) {
+          data_begin = data_end = end;
+        }
+        data_begin = std::min(data_begin, end);
+        data_end = std::min(data_end, end);
+        if (data_begin > pos &&
+            !WriteHole(dst_file->file, dst_offset + (pos - offset),
+                       data_begin - pos)) {
+          status = IOStatus::Failed;
           break;
         }
-        std::fwrite(buffer, 1, read, dst_handle);
-        read_size += read;
+        for (pos = data_begin; pos < data_end; pos += chunk_size) {
+          chunks.push_back({pos, dst_offset + (pos - offset),
+                            std::min(chunk_size, data_end - pos)});
+        }
+        pos = data_end;
+      }
+      uint64_t hole_size = pos - offset;
+      for (auto &chunk : chunks) {
+        hole_size -= chunk.size;
+      }
+      ChunkedCopy copy{src_file->file, dst_file->file, path, state};
+      if (status == IOStatus::Success) {
+        ParallelFor(chunks.size(),
+                    [&](size_t index) { copy.Run(chunks[index]); });
+        status = copy.status;
       }
-      std::fclose(src_handle);
-      std::fclose(dst_handle);
+      // a trailing hole leaves the destination short otherwise
+      uint64_t dst_end = dst_offset + (end - offset);
+      if (status == IOStatus::Success && end > offset &&
+          FileIO::Size(dst_file->file) < (int64_t)dst_end &&
+          !FileIO::Truncate(dst_file->file, dst_end)) {
+        status = IOStatus::Failed;
+      }
+      if (status == IOStatus::Success && end < offset + src_size) {
+        status = IOStatus::ShortTransfer;
+      }
+      state->Complete(status, hole_size + copy.copied);
     });
   }
-  void _EnqueueSignal(Event *event_handle, uint64_t timeline) {
-    std::lock_guard<std::mutex> lk(mutex);
-    requests.push_back([=, this]() { event_handle->Signal(timeline); });
+  struct CopyChunk {
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t size;
+  };
+  struct ChunkedCopy {
+    native_file src;
+    native_file dst;
+    const char *path;
+    IOCmdState *state;
+    std::atomic_uint64_t copied = 0;
+    // first failure of any chunk
+    std::atomic<IOStatus> status = IOStatus::Success;
+
+    void Fail(IOStatus failure) {
+      IOStatus expected = IOStatus::Success;
+      status.compare_exchange_strong(expected, failure);
+    }
+    void Run(const CopyChunk &chunk) {
+      thread_local std::vector<char> buffer(IO_CHUNK_SIZE);
+      uint64_t done = 0;
+      while (done < chunk.size && status == IOStatus::Success) {
+        if (state->IsExpired(path)) {
+          Fail(IOStatus::Timeout);
+          break;
+        }
+        size_t to_read = std::min<uint64_t>(buffer.size(), chunk.size - done);
+        int64_t read = FileIO::ReadAt(src, buffer.data(), to_read,
+                                      chunk.src_offset + done);
+        int64_t written =
+            read > 0 ? FileIO::WriteAt(dst, buffer.data(), read,
+                                       chunk.dst_offset + done)
+                     : 0;
+        if (read < 0 || written < 0) {
+          Fail(IOStatus::Failed);
+          break;
+        }
+        done += written;
+        if ((size_t)read < to_read || written < read) {
+          Fail(IOStatus::ShortTransfer);
+          break;
+        }
+      }
+      copied += done;
+    }
+  };
+  // Runs task(i) for every i below count and returns once all are done. A
+  // single task runs on the looper, more are spread across the workers.
+  template <typename TFunc> void ParallelFor(size_t count, const TFunc &task) {
+    if (count <= 1) {
+      for (size_t i = 0; i < count; ++i) {
+        task(i);
+      }
+      return;
+    }
+    std::latch done(count);
+    for (size_t i = 0; i < count; ++i) {
+      workers.Submit([&task, &done, i]() {
+        task(i);
+        done.count_down();
+      });
+    }
+    done.wait();
+  }
+  // the range reads as zeros afterwards, written out where holes are not
+  // supported
+  static bool WriteHole(native_file file, uint64_t offset, uint64_t size) {
+    if (FileIO::PunchHole(file, offset, size)) {
+      return true;
+    }
+    static const char zeros[4096] = {};
+    while (size > 0) {
+      size_t to_write = std::min<uint64_t>(sizeof(zeros), size);
+      if (FileIO::WriteAt(file, zeros, to_write, offset) !=
+          (int64_t)to_write) {
+        return false;
+      }
+      offset += to_write;
+      size -= to_write;
+    }
+    return true;
+  }
+  // stores the hash in the result and checks it against the expected one
+  static IOStatus FinishChecksum(IOCmdState *state,
+                                 const ReadChecksum &checksum, IOStatus status,
+                                 const char *path) {
+    if (state->checksum == IOChecksum::None) {
+      return status;
+    }
+    state->result.checksum = checksum.Digest();
+    if (status == IOStatus::Success && state->expected_checksum &&
+        *state->expected_checksum != state->result.checksum) {
+      SPDLOG_ERROR("Checksum mismatch in {}", path);
+      return IOStatus::ChecksumMismatch;
+    }
+    return status;
+  }
+  static IOStatus ToStatus(FileError error) {
+    switch (error) {
+    case FileError::None:
+      return IOStatus::Success;
+    case FileError::NotFound:
+      return IOStatus::NotFound;
+    case FileError::AlreadyExists:
+      return IOStatus::AlreadyExists;
+    default:
+      return IOStatus::Failed;
+    }
+  }
+  void _EnqueueMetaRequest(IOCmdType type, file_handle handle,
+                           file_handle dst_handle, uint32_t flags,
+                           FileMetadata *metadata, IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      auto &table = PathTable::Get();
+      auto *path = table.Path(handle);
+      auto *dst_path = table.Path(dst_handle);
+      if (!path || !dst_path) {
+        state->Complete(IOStatus::InvalidHandle, 0);
+        return;
+      }
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      if (type != IOCmdType::Stat) {
+        DropReadAhead(handle);
+        DropReadAhead(dst_handle);
+      }
+      bool succeeded = true;
+      switch (type) {
+      case IOCmdType::Stat: {
+        FileMetadata result;
+        succeeded = FileIO::Stat(path, &result);
+        if (succeeded || FileIO::LastError() == FileError::NotFound) {
+          table.SetMetadata(handle, result);
+        }
+        if (metadata) {
+          *metadata = result;
+        }
+        break;
+      }
+      case IOCmdType::Open: {
+        bool write = flags & (IO_OPEN_WRITE | IO_OPEN_CREATE |
+                              IO_OPEN_TRUNCATE);
+        uint32_t open_flags = 0;
+        if (flags & IO_OPEN_CREATE) {
+          open_flags |= FILE_OPEN_CREATE;
+        }
+        if (flags & IO_OPEN_TRUNCATE) {
+          open_flags |= FILE_OPEN_TRUNCATE;
+        }
+        if (open_flags) {
+          // the cached descriptors may refer to a file that gets replaced
+          FileCache::Get().Evict(handle);
+          table.InvalidateMetadata(handle);
+        }
+        succeeded = FileCache::Get().Acquire(
+                        handle, write ? FileAccess::ReadWrite : FileAccess::Read,
+                        open_flags) != nullptr;
+        break;
+      }
+      case IOCmdType::Close:
+        FileCache::Get().Evict(handle);
+        break;
+      case IOCmdType::Unlink:
+        succeeded = FileIO::Unlink(path);
+        if (succeeded) {
+          FileCache::Get().Evict(handle);
+          table.Release(handle);
+        }
+        break;
+      case IOCmdType::Rename:
+        succeeded = FileIO::Rename(path, dst_path);
+        if (succeeded) {
+          // descriptors of the destination refer to the replaced file
+          FileCache::Get().Evict(handle);
+          FileCache::Get().Evict(dst_handle);
+          table.Release(handle);
+          table.InvalidateMetadata(dst_handle);
+        }
+        break;
+      case IOCmdType::MakeDir:
+        succeeded = FileIO::MakeDirectory(path);
+        if (succeeded) {
+          table.InvalidateMetadata(handle);
+        }
+        break;
+      default:
+        state->Complete(IOStatus::InvalidCommand, 0);
+        return;
+      }
+      state->Complete(succeeded ? IOStatus::Success
+                                : ToStatus(FileIO::LastError()),
+                      0);
+    });
+  }
+  void _EnqueueMemRequest(uint8_t *dst, const uint8_t *src, size_t size,
+                          uint32_t pattern, IOStatus status,
+                          IOCmdState *state) {
+    Push(state->batch, [=, this]() mutable {
+      if (state->IsExpired("memory")) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      size_t count = (size + MEM_CHUNK_SIZE - 1) / MEM_CHUNK_SIZE;
+      ParallelFor(count, [&](size_t index) {
+        size_t offset = index * MEM_CHUNK_SIZE;
+        size_t chunk = std::min(MEM_CHUNK_SIZE, size - offset);
+        if (src) {
+          MemCopy(dst + offset, src + offset, chunk);
+        } else {
+          // chunks start at multiples of 4, the pattern phase is unchanged
+          MemFill(dst + offset, pattern, chunk);
+        }
+      });
+      // copies hash what they copied, e.g. entries split off a larger read
+      if (src && state->checksum != IOChecksum::None) {
+        ReadChecksum checksum(state->checksum);
+        checksum.Update(dst, size);
+        status = FinishChecksum(state, checksum, status, "memory");
+      }
+      state->Complete(status, size);
+    });
+  }
+  void _EnqueueDecompress(const FileDesc &src, const RawDataDesc &dst,
+                          IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      auto *path = PathTable::Get().Path(src.handle);
+      if (!path) {
+        state->Complete(IOStatus::InvalidHandle, 0);
+        return;
+      }
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      auto file = FileCache::Get().Acquire(src.handle, FileAccess::Read);
+      if (!file) {
+        SPDLOG_ERROR("Failed to open file {}", path);
+        state->Complete(IOStatus::OpenFailed, 0);
+        return;
+      }
+      auto job = std::make_shared<DecodeJob>();
+      if (src.size < sizeof(CompressedHeader) ||
+          FileIO::ReadAt(file->file, &job->header, sizeof(CompressedHeader),
+                         src.offset) != sizeof(CompressedHeader)) {
+        state->Complete(IOStatus::ShortTransfer, 0);
+        return;
+      }
+      auto &header = job->header;
+      size_t payload_size = src.size - sizeof(CompressedHeader);
+      if (!BlockCodec::IsValid(header) ||
+          BlockCodec::TableSize(header) > payload_size) {
+        SPDLOG_ERROR("Invalid compressed payload in {}", path);
+        state->Complete(IOStatus::CorruptData, 0);
+        return;
+      }
+      if (header.raw_size > dst.data.size()) {
+        state->Complete(IOStatus::ShortTransfer, 0);
+        return;
+      }
+      job->staging.resize(payload_size);
+      int64_t read =
+          FileIO::ReadAt(file->file, job->staging.data(), payload_size,
+                         src.offset + sizeof(CompressedHeader));
+      if (read != (int64_t)payload_size) {
+        state->Complete(read < 0 ? IOStatus::Failed : IOStatus::ShortTransfer,
+                        0);
+        return;
+      }
+      // the hash covers the payload as stored
+      ReadChecksum checksum(state->checksum);
+      checksum.Update(&header, sizeof(header));
+      checksum.Update(job->staging.data(), payload_size);
+      if (FinishChecksum(state, checksum, IOStatus::Success, path) !=
+          IOStatus::Success) {
+        state->Complete(IOStatus::ChecksumMismatch, 0);
+        return;
+      }
+      auto *sizes = reinterpret_cast<const uint32_t *>(job->staging.data());
+      size_t offset = BlockCodec::TableSize(header);
+      job->block_offsets.resize(header.block_count);
+      for (size_t i = 0; i < header.block_count; ++i) {
+        job->block_offsets[i] = offset;
+        offset += sizes[i] & ~BlockCodec::STORED_BLOCK;
+      }
+      if (offset > payload_size) {
+        SPDLOG_ERROR("Invalid compressed payload in {}", path);
+        state->Complete(IOStatus::CorruptData, 0);
+        return;
+      }
+      if (header.block_count == 0) {
+        state->Complete(IOStatus::Success, 0);
+        return;
+      }
+      job->dst = dst.data.data();
+      job->state = state;
+      job->batch = state->batch;
+      job->remaining = header.block_count;
+      decoding.push_back(job);
+      for (size_t i = 0; i < header.block_count; ++i) {
+        workers.Submit([job, i]() { job->Decode(i); });
+      }
+    });
+  }
+  void _EnqueueCompress(const RawDataDesc &src, const FileDesc &dst,
+                        CompressionCodec codec, IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      auto *path = PathTable::Get().Path(dst.handle);
+      if (!path) {
+        state->Complete(IOStatus::InvalidHandle, 0);
+        return;
+      }
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      auto file = FileCache::Get().Acquire(dst.handle, FileAccess::ReadWrite);
+      if (!file) {
+        SPDLOG_ERROR("Failed to open file {}", path);
+        state->Complete(IOStatus::OpenFailed, 0);
+        return;
+      }
+      DropReadAhead(dst.handle);
+      const uint8_t *raw = src.data.data();
+      size_t raw_size = src.data.size();
+      std::vector<uint8_t> payload(BlockCodec::PayloadBound(codec, raw_size));
+      size_t size = BlockCodec::EncodePayload(
+          codec, raw, raw_size, payload.data(),
+          [this](size_t count, const auto &task) { ParallelFor(count, task); });
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      int64_t written = FileIO::WriteAt(file->file, payload.data(), size,
+                                        dst.offset);
+      IOStatus status = written < 0              ? IOStatus::Failed
+                        : (size_t)written < size ? IOStatus::ShortTransfer
+                                                 : IOStatus::Success;
+      state->Complete(status, status == IOStatus::Success ? size : 0);
+    });
+  }
+  // later commands of a list must see its payloads decoded
+  void WaitDecoding(const IOBatch *batch) {
+    for (auto &job : decoding) {
+      if (job->batch == batch) {
+        job->done.wait(false, std::memory_order_acquire);
+      }
+    }
+  }
+  // releases the staging buffers of finished jobs
+  void PruneDecoding() {
+    std::erase_if(decoding, [](const std::shared_ptr<DecodeJob> &job) {
+      return job->done.load(std::memory_order_acquire);
+    });
+  }
+  void _EnqueueSpaceRequest(IOCmdType type, const FileDesc &range,
+                            IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      auto *path = PathTable::Get().Path(range.handle);
+      if (!path) {
+        state->Complete(IOStatus::InvalidHandle, 0);
+        return;
+      }
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      auto file = FileCache::Get().Acquire(range.handle, FileAccess::ReadWrite);
+      if (!file) {
+        SPDLOG_ERROR("Failed to open file {}", path);
+        state->Complete(IOStatus::OpenFailed, 0);
+        return;
+      }
+      DropReadAhead(range.handle);
+      bool succeeded;
+      switch (type) {
+      case IOCmdType::Allocate:
+        succeeded = FileIO::Allocate(file->file, range.offset, range.size);
+        break;
+      case IOCmdType::Truncate:
+        succeeded = FileIO::Truncate(file->file, range.size);
+        break;
+      default:
+        succeeded = FileIO::PunchHole(file->file, range.offset, range.size);
+        break;
+      }
+      if (!succeeded) {
+        SPDLOG_ERROR("Failed to resize {}", path);
+        state->Complete(IOStatus::Failed, 0);
+        return;
+      }
+      PathTable::Get().InvalidateMetadata(range.handle);
+      state->Complete(IOStatus::Success, 0);
+    });
+  }
+  void _EnqueueFlush(const FileDesc &range, IOFlushMode mode,
+                     IOCmdState *state) {
+    Push(state->batch, [=, this]() {
+      auto *path = PathTable::Get().Path(range.handle);
+      if (!path) {
+        state->Complete(IOStatus::InvalidHandle, 0);
+        return;
+      }
+      if (state->IsExpired(path)) {
+        state->Complete(IOStatus::Timeout, 0);
+        return;
+      }
+      auto file = FileCache::Get().Acquire(range.handle, FileAccess::ReadWrite);
+      if (!file) {
+        SPDLOG_ERROR("Failed to open file {}", path);
+        state->Complete(IOStatus::OpenFailed, 0);
+        return;
+      }
+      auto sync_mode = (FileSyncMode)mode;
+      if (mode == IOFlushMode::Range || group_commit_window_us < 0) {
+        bool succeeded =
+            FileIO::Sync(file->file, sync_mode, range.offset, range.size);
+        state->Complete(succeeded ? IOStatus::Success : IOStatus::Failed, 0);
+        return;
+      }
+      DeferFlush(range.handle, std::move(file), sync_mode, state);
+    });
+  }
+  void DeferFlush(file_handle handle, OpenFilePtr &&file, FileSyncMode mode,
+                  IOCmdState *state) {
+    if (deferred_flushes.empty()) {
+      first_deferred = Clock::now();
+    }
+    for (auto &flush : deferred_flushes) {
+      if (flush.handle == handle) {
+        // Full covers Data
+        flush.mode = std::min(flush.mode, mode);
+        flush.waiters.push_back(state);
+        return;
+      }
+    }
+    deferred_flushes.push_back({handle, std::move(file), mode, {state}});
+  }
+  bool HasDeferredFlush(const IOBatch *batch) const {
+    for (auto &flush : deferred_flushes) {
+      for (auto *waiter : flush.waiters) {
+        if (waiter->batch == batch) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+  bool IsGroupCommitDue() const {
+    auto window = std::chrono::microseconds(group_commit_window_us.load());
+    return window.count() < 0 || Clock::now() - first_deferred >= window;
+  }
+  // sleeps until the group commit window closes or a request arrives
+  void WaitGroupCommit() {
+    auto window = std::chrono::microseconds(group_commit_window_us.load());
+    std::unique_lock<std::mutex> lk(mutex);
+    wakeup.wait_until(lk, first_deferred + window,
+                      [this]() { return !requests.empty() || !enabled; });
+  }
+  // one syscall per file covers every write that ran before it
+  void CommitFlushes() {
+    for (auto &flush : deferred_flushes) {
+      bool succeeded = FileIO::Sync(flush.file->file, flush.mode);
+      for (auto *waiter : flush.waiters) {
+        waiter->Complete(succeeded ? IOStatus::Success : IOStatus::Failed, 0);
+      }
+    }
+    deferred_flushes.clear();
+  }
+  void _EnqueuePrefetch(std::vector<file_handle> &&handles) {
+    Push(nullptr,
+         [handles = std::move(handles)]() { PrefetchFiles(handles); });
+  }
+  // Records metadata of the files and opens them for reading ahead of the
+  // commands that use them. Only the first files up to the cache capacity
+  // are opened, opening more would just evict the earlier ones. On POSIX
+  // each parent directory is opened once and the files are resolved
+  // relative to it.
+  static void PrefetchFiles(std::span<const file_handle> handles) {
+    auto &table = PathTable::Get();
+#if defined(_WIN32)
+    size_t opened = 0;
+    for (auto handle : handles) {
+      auto *path = table.Path(handle);
+      FileMetadata metadata;
+      if (!path) {
+        continue;
+      }
+      FileIO::Stat(path, &metadata);
+      table.SetMetadata(handle, metadata);
+      if (metadata.is_regular && opened++ < FileCache::MAX_OPEN_FILES) {
+        FileCache::Get().Acquire(handle, FileAccess::Read);
+      }
+    }
+#else
+    struct Item {
+      std::string_view dir;
+      std::string_view name;
+      file_handle handle;
+      bool open;
+    };
+    std::vector<Item> items;
+    items.reserve(handles.size());
+    for (auto handle : handles) {
+      auto *path = table.Path(handle);
+      if (!path) {
+        continue;
+      }
+      std::string_view full(path);
+      size_t slash = full.rfind('/');
+      bool open = items.size() < FileCache::MAX_OPEN_FILES;
+      if (slash == std::string_view::npos) {
+        items.push_back({".", full, handle, open});
+      } else {
+        items.push_back({full.substr(0, std::max<size_t>(slash, 1)),
+                         full.substr(slash + 1), handle, open});
+      }
+    }
+    std::sort(items.begin(), items.end(),
+              [](auto &a, auto &b) { return a.dir < b.dir; });
+    std::string name;
+    for (size_t begin = 0, end = 0; begin < items.size(); begin = end) {
+      while (end < items.size() && items[end].dir == items[begin].dir) {
+        ++end;
+      }
+      native_file dir =
+          FileIO::OpenDirectory(std::string(items[begin].dir).c_str());
+      for (size_t i = begin; i < end; ++i) {
+        FileMetadata metadata;
+        name = items[i].name;
+        if (dir != FileIO::INVALID_FILE) {
+          FileIO::StatAt(dir, name.c_str(), &metadata);
+        }
+        table.SetMetadata(items[i].handle, metadata);
+        if (!metadata.is_regular) {
+          SPDLOG_ERROR("File {} does not exist", table.Path(items[i].handle));
+          continue;
+        }
+        if (!items[i].open) {
+          continue;
+        }
+        native_file file =
+            FileIO::OpenAt(dir, name.c_str(), FileAccess::Read);
+        if (file != FileIO::INVALID_FILE) {
+          FileCache::Get().Insert(items[i].handle, FileAccess::Read, file);
+        }
+      }
+      FileIO::Close(dir);
+    }
+#endif
   }
   void _WorkLoop() {
-    SPDLOG_INFO("IOLooper started");
+    SPDLOG_INFO("IOLooper started, {} memory kernels", MemKernelName());
     while (enabled) {
-      std::vector<std::function<void(void)>> requests_copy;
+      std::vector<LooperRequest> requests_copy;
       {
         std::lock_guard<std::mutex> lk(mutex);
         requests_copy = std::move(requests);
       }
       if (requests_copy.empty()) {
-        std::this_thread::yield();
+        // decode jobs are polled, so only an otherwise idle looper sleeps
+        if (!deferred_flushes.empty() && decoding.empty() &&
+            !IsGroupCommitDue()) {
+          WaitGroupCommit();
+        } else {
+          std::this_thread::yield();
+        }
       }
       for (auto &request : requests_copy) {
-        request();
+        if (!decoding.empty() && request.batch) {
+          WaitDecoding(request.batch);
+        }
+        // later commands of a list must see its flushes completed
+        if (!deferred_flushes.empty() && request.batch &&
+            HasDeferredFlush(request.batch)) {
+          CommitFlushes();
+        }
+        request.run();
+      }
+      if (!deferred_flushes.empty() && IsGroupCommitDue()) {
+        CommitFlushes();
+      }
+      if (!decoding.empty()) {
+        PruneDecoding();
       }
     }
+    CommitFlushes();
     SPDLOG_INFO("IOLooper exited");
   }
 };
 
 struct IOCommandListHolder {
-  std::vector<IOCmd> cmds;
-  std::vector<IOCallBack> callbacks;
-  std::vector<file_handle> files;
+  IOCmdStoragePtr storage;
   uint64_t time_stamp;
+  Clock::time_point submit_time;
+  bool out_of_order;
+  IOCompletionQueue *completion_queue;
 };
 
 struct IOHandler {
-  struct CallBacks {
-    std::vector<IOCallBack> callbacks;
-    std::vector<file_handle> files;
-    uint64_t time_stamp;
-  };
   uint64_t time_stamp;
   std::queue<IOCommandListHolder> cmd_batches;
   std::mutex mutex;
   Event event;
   uint64_t EnqueueCmds(IOCommandList &cmd_list) {
-    if (cmd_list.cmds.empty()) {
+    if (cmd_list.Empty()) {
       return time_stamp;
     }
-    {
-      std::unique_lock<std::mutex> lk(mutex);
-      cmd_batches.emplace(std::move(cmd_list.cmds),
-                          std::move(cmd_list.callbacks),
-                          std::move(cmd_list.files), ++time_stamp);
+    // the list acquires fresh storage when it records again
+    std::unique_lock<std::mutex> lk(mutex);
+    cmd_batches.emplace(std::move(cmd_list.storage), ++time_stamp,
+                        Clock::now(), cmd_list.out_of_order,
+                        cmd_list.completion_queue);
+    return time_stamp;
+  }
+  uint64_t EnqueueCmds(const IOCommandBundle &bundle, IOCallBack &&callback) {
+    if (bundle.storage->cmds.empty()) {
+      return time_stamp;
+    }
+    // copies the commands, their handles index the process wide PathTable
+    auto storage = IOCmdStorage::Acquire();
+    storage->cmds.reserve(bundle.storage->cmds.size());
+    for (auto &cmd : bundle.storage->cmds) {
+      storage->cmds.push_back(
+          cmd.CopyWithoutCallback());
     }
+    if (callback) {
+      storage->callbacks.push_back(std::move(callback));
+    }
+    std::unique_lock<std::mutex> lk(mutex);
+    cmd_batches.emplace(std::move(storage), ++time_stamp, Clock::now(),
+                        bundle.out_of_order, bundle.completion_queue);
     return time_stamp;
   }
-  std::queue<CallBacks> _callbacks;
+  void StartTraceRecording() {
+    std::lock_guard<std::mutex> lk(trace_mutex);
+    recording.emplace();
+    recording_start = Clock::now();
+    tracing = true;
+  }
+  AccessTrace StopTraceRecording() {
+    std::lock_guard<std::mutex> lk(trace_mutex);
+    AccessTrace trace;
+    if (recording) {
+      trace = std::move(*recording);
+      recording.reset();
+    }
+    tracing = replay != nullptr;
+    return trace;
+  }
+  void ReplayTrace(const AccessTrace &trace) {
+    auto prefetcher = std::make_unique<TracePrefetcher>();
+    prefetcher->Start(trace);
+    // stopped after the lock is released
+    std::unique_ptr<TracePrefetcher> previous;
+    std::lock_guard<std::mutex> lk(trace_mutex);
+    previous = std::move(replay);
+    replay = std::move(prefetcher);
+    tracing = true;
+  }
+  void SetReadSharing(bool enabled) { sharing = enabled; }
+  void StopReplay() {
+    std::unique_ptr<TracePrefetcher> previous;
+    std::lock_guard<std::mutex> lk(trace_mutex);
+    previous = std::move(replay);
+    tracing = recording.has_value();
+  }
+  // in flight batches in time stamp order
+  std::deque<std::unique_ptr<IOBatch>> _batches;
+  CompletedCmds _completed;
+  // queues whose ring was full when completions were posted
+  std::vector<IOCompletionQueue *> _overflowed;
   void Tick() {
     IOCommandListHolder cmds_batch;
     bool has_cmds = false;
@@ -167,55 +1577,317 @@ struct IOHandler {
     if (has_cmds) {
       AsyncExecuteCmds(cmds_batch);
     }
-    if (!_callbacks.empty()) {
-      auto &first = _callbacks.front();
-      if (event.IsSignaled(first.time_stamp)) {
-        for (auto &callback : first.callbacks) {
-          callback();
-        }
-        for (auto &file : first.files) {
-          delete[] file.file;
-        }
-        _callbacks.pop();
-        ;
-      }
-    } else {
+    bool progressed = RetireBatches();
+    std::erase_if(_overflowed, [](IOCompletionQueue *queue) {
+      return !queue->FlushOverflow();
+    });
+    if (!progressed && !has_cmds) {
       std::this_thread::yield();
     }
   }
 
   void Join() {
-    Tick();
-    while (!_callbacks.empty()) {
-      auto &first = _callbacks.front();
-      event.Wait(first.time_stamp);
-      for (auto &callback : first.callbacks) {
-        callback();
+    while (!_batches.empty() || HasPendingCmds()) {
+      Tick();
+    }
+  }
+
+  void TrackOverflow(IOCompletionQueue *queue) {
+    if (!queue->overflow.empty() &&
+        std::find(_overflowed.begin(), _overflowed.end(), queue) ==
+            _overflowed.end()) {
+      _overflowed.push_back(queue);
+    }
+  }
+
+private:
+  // guards the recording and the replay, taken once per batch while either
+  // of them is active
+  std::mutex trace_mutex;
+  std::atomic_bool tracing = false;
+  std::optional<AccessTrace> recording;
+  Clock::time_point recording_start;
+  std::unique_ptr<TracePrefetcher> replay;
+  std::atomic_bool sharing = true;
+  // reads handed to the looper that later reads may attach to, keyed by
+  // path index
+  std::unordered_map<uint32_t, std::vector<std::shared_ptr<SharedRead>>>
+      shared_reads;
+  size_t shared_read_count = 0;
+
+  // calls visit(file, size, kind) for each file the command accesses
+  template <typename TFunc>
+  static void VisitAccesses(const IOCmd &cmd, const TFunc &visit) {
+    auto *src = std::get_if<FileDesc>(&cmd.src);
+    auto *dst = std::get_if<FileDesc>(&cmd.dst);
+    auto *src_data = std::get_if<RawDataDesc>(&cmd.src);
+    auto *dst_data = std::get_if<RawDataDesc>(&cmd.dst);
+    switch (cmd.type) {
+    case IOCmdType::Copy:
+    case IOCmdType::Decompress:
+    case IOCmdType::Compress:
+      // the memory side determines the size where there is one
+      if (src) {
+        visit(*src, dst_data && cmd.type == IOCmdType::Copy
+                        ? dst_data->data.size()
+                        : src->size,
+              AccessKind::Read);
+      }
+      if (dst) {
+        visit(*dst, src_data ? src_data->data.size() : dst->size,
+              AccessKind::Write);
       }
-      for (auto &file : first.files) {
-        delete[] file.file;
+      break;
+    case IOCmdType::Flush:
+    case IOCmdType::Allocate:
+    case IOCmdType::Truncate:
+    case IOCmdType::PunchHole:
+      visit(*src, src->size, AccessKind::Write);
+      break;
+    case IOCmdType::Fill:
+      break;
+    default:
+      visit(*src, 0, AccessKind::Meta);
+      if (cmd.type == IOCmdType::Rename) {
+        visit(*dst, 0, AccessKind::Meta);
       }
-      _callbacks.pop();
+      break;
+    }
+  }
+  // records the commands and cancels the prefetches they make redundant
+  void TraceCmds(std::span<const IOCmd> cmds, Clock::time_point submit_time) {
+    // a finished replay is stopped after the lock is released
+    std::unique_ptr<TracePrefetcher> finished;
+    std::lock_guard<std::mutex> lk(trace_mutex);
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::max(submit_time - recording_start, Clock::duration::zero()));
+    for (auto &cmd : cmds) {
+      VisitAccesses(cmd, [&](const FileDesc &file, uint64_t size,
+                             AccessKind kind) {
+        if (recording) {
+          recording->Add({time, file.handle, file.offset, size, kind});
+        }
+        if (replay && kind == AccessKind::Read) {
+          replay->Cancel(file.handle, file.offset, size);
+        }
+      });
     }
+    if (replay && !replay->IsActive()) {
+      finished = std::move(replay);
+    }
+    tracing = recording || replay;
+  }
+  // Completes a read into memory right away if the block cache holds all of
+  // it, or attaches it to an in flight read of the looper that covers it.
+  // Otherwise the read fills the cache and may be shared in turn. Commands
+  // changing a file make its cached blocks stale and end sharing of its
+  // reads. Returns true if the command was taken care of.
+  bool ShortcutCmd(const IOCmd &cmd, IOCmdState *state, bool caching,
+                   std::vector<std::span<const uint8_t>> &pending) {
+    auto &cache = BlockCache::Get();
+    bool replaces = cmd.type == IOCmdType::Unlink ||
+                    cmd.type == IOCmdType::Rename ||
+                    (cmd.type == IOCmdType::Open &&
+                     (cmd.flags & (IO_OPEN_CREATE | IO_OPEN_TRUNCATE)));
+    VisitAccesses(cmd, [&](const FileDesc &file, uint64_t, AccessKind kind) {
+      if (kind == AccessKind::Write || replaces) {
+        if (caching) {
+          cache.Invalidate(file.handle);
+        }
+        shared_reads.erase(file.handle.index);
+      }
+    });
+    auto *src = std::get_if<FileDesc>(&cmd.src);
+    auto *dst = std::get_if<RawDataDesc>(&cmd.dst);
+    if (cmd.type == IOCmdType::Copy && src && dst) {
+      // neither may overtake an earlier command of the list that uses the
+      // same memory on the backend
+      bool ordered = pending.size() < MAX_PENDING_SPANS;
+      for (size_t i = 0; ordered && i < pending.size(); ++i) {
+        ordered = !Overlaps(pending[i], dst->data);
+      }
+      if (ordered && caching && state->checksum == IOChecksum::None &&
+          cache.Read(src->handle, src->offset, dst->data.data(),
+                     dst->data.size())) {
+        state->Complete(IOStatus::Success, dst->data.size());
+        return true;
+      }
+      if (ordered && sharing && AttachSharedRead(*src, *dst, state)) {
+        return true;
+      }
+      if (caching) {
+        state->cache_epoch = cache.Epoch(src->handle);
+      }
+      // a timed out leader would leave its followers without data
+      if (sharing && !dst->data.empty() &&
+          state->deadline == Deadline::max()) {
+        state->shared_read = std::make_shared<SharedRead>(
+            src->handle, src->offset, dst->data);
+        AddSharedRead(state->shared_read);
+      }
+    }
+    for (auto *target : {&cmd.src, &cmd.dst}) {
+      if (auto *data = std::get_if<RawDataDesc>(target)) {
+        pending.push_back(data->data);
+      }
+    }
+    return false;
+  }
+  // followers complete with the leader, so they must not have a deadline
+  bool AttachSharedRead(const FileDesc &src, const RawDataDesc &dst,
+                        IOCmdState *state) {
+    auto iter = shared_reads.find(src.handle.index);
+    if (iter == shared_reads.end() || state->deadline != Deadline::max()) {
+      return false;
+    }
+    for (auto &read : iter->second) {
+      if (read->handle == src.handle &&
+          read->Contains(src.offset, dst.data.size()) &&
+          read->Attach({src.offset, dst.data, state})) {
+        return true;
+      }
+    }
+    return false;
+  }
+  void AddSharedRead(const std::shared_ptr<SharedRead> &read) {
+    auto &reads = shared_reads[read->handle.index];
+    std::erase_if(reads, [](auto &read) { return read->IsFinished(); });
+    reads.push_back(read);
+    if (++shared_read_count > MAX_SHARED_READS) {
+      shared_read_count = 0;
+      for (auto iter = shared_reads.begin(); iter != shared_reads.end();) {
+        std::erase_if(iter->second,
+                      [](auto &read) { return read->IsFinished(); });
+        shared_read_count += iter->second.size();
+        iter = iter->second.empty() ? shared_reads.erase(iter) : ++iter;
+      }
+    }
+  }
+  static bool Overlaps(std::span<const uint8_t> lhs,
+                       std::span<const uint8_t> rhs) {
+    return lhs.data() < rhs.data() + rhs.size() &&
+           rhs.data() < lhs.data() + lhs.size();
+  }
+  bool HasPendingCmds() {
+    std::unique_lock<std::mutex> lk(mutex);
+    return !cmd_batches.empty();
+  }
+  // returns true if any callback fired or any batch was retired
+  bool RetireBatches() {
+    if (_batches.empty()) {
+      return false;
+    }
+    // sample completion before draining, every command of a done batch has
+    // pushed itself to _completed by then
+    size_t retired = 0;
+    while (retired < _batches.size() && _batches[retired]->IsDone()) {
+      ++retired;
+    }
+    std::vector<IOBatch *> done_out_of_order;
+    for (size_t i = retired; i < _batches.size(); ++i) {
+      auto &batch = _batches[i];
+      if (batch->completed && !batch->callbacks_fired && batch->IsDone()) {
+        done_out_of_order.push_back(batch.get());
+      }
+    }
+    std::vector<IOCmdState *> completed;
+    {
+      std::lock_guard<std::mutex> lk(_completed.mutex);
+      completed.swap(_completed.states);
+    }
+    for (auto *state : completed) {
+      state->Deliver();
+      if (state->batch->queue) {
+        TrackOverflow(state->batch->queue);
+      }
+    }
+    for (auto *batch : done_out_of_order) {
+      batch->InvokeCallbacks();
+    }
+    // the timeline only advances over contiguous done batches
+    for (size_t i = 0; i < retired; ++i) {
+      auto batch = std::move(_batches.front());
+      _batches.pop_front();
+      event.Signal(batch->time_stamp);
+      if (!batch->callbacks_fired) {
+        batch->InvokeCallbacks();
+        if (batch->queue) {
+          TrackOverflow(batch->queue);
+        }
+      }
+    }
+    return retired > 0 || !completed.empty() || !done_out_of_order.empty();
   }
 
-private:
   void AsyncExecuteCmds(IOCommandListHolder &cmd_holder) {
-    auto &&cmds = std::move(cmd_holder.cmds);
-    auto &&callbacks = std::move(cmd_holder.callbacks);
-    auto &&files = std::move(cmd_holder.files);
-    bool has_commands = false;
-
+    auto batch = std::make_unique<IOBatch>(std::move(cmd_holder.storage));
+    auto &cmds = batch->storage->cmds;
     if (cmds.empty()) {
       return;
     }
-    auto exit_func = OnExitScope([&]() {
-      _callbacks.push(
-          {std::move(callbacks), std::move(files), cmd_holder.time_stamp});
-    });
+    batch->time_stamp = cmd_holder.time_stamp;
+    batch->completed = cmd_holder.out_of_order ? &_completed : nullptr;
+    batch->queue = cmd_holder.completion_queue;
+    batch->pending = cmds.size();
+    if (tracing.load(std::memory_order_relaxed)) {
+      TraceCmds(cmds, cmd_holder.submit_time);
+    }
+    auto &states = batch->states;
+    bool caching = BlockCache::Get().IsEnabled();
+    bool shortcuts = caching || sharing;
+    // memory of the commands handed to the looper so far
+    std::vector<std::span<const uint8_t>> pending_memory;
+    // the batch owns the states and outlives the looper requests
+    _batches.push_back(std::move(batch));
     // iterate over commands
-    for (auto &cmd : cmds) {
-      has_commands = true;
+    for (size_t i = 0; i < cmds.size(); ++i) {
+      auto &cmd = cmds[i];
+      auto *state = &states[i];
+      state->submit_time = cmd_holder.submit_time;
+      state->user_result = cmd.options.result;
+      state->callback = std::move(cmd.options.callback);
+      state->user_data = cmd.options.user_data;
+      state->checksum = cmd.options.checksum;
+      state->expected_checksum = cmd.options.expected_checksum;
+      state->batch = _batches.back().get();
+      if (cmd.options.timeout.count() > 0) {
+        state->deadline = cmd_holder.submit_time + cmd.options.timeout;
+      }
+      if (shortcuts && ShortcutCmd(cmd, state, caching, pending_memory)) {
+        continue;
+      }
+      if (cmd.type == IOCmdType::Flush) {
+        IOLooper::EnqueueFlush(std::get<FileDesc>(cmd.src),
+                               (IOFlushMode)cmd.flags, state);
+        continue;
+      }
+      if (cmd.type == IOCmdType::Allocate || cmd.type == IOCmdType::Truncate ||
+          cmd.type == IOCmdType::PunchHole) {
+        IOLooper::EnqueueSpaceRequest(cmd.type, std::get<FileDesc>(cmd.src),
+                                      state);
+        continue;
+      }
+      if (cmd.type == IOCmdType::Decompress) {
+        IOLooper::EnqueueDecompress(std::get<FileDesc>(cmd.src),
+                                    std::get<RawDataDesc>(cmd.dst), state);
+        continue;
+      }
+      if (cmd.type == IOCmdType::Compress) {
+        IOLooper::EnqueueCompress(std::get<RawDataDesc>(cmd.src),
+                                  std::get<FileDesc>(cmd.dst),
+                                  (CompressionCodec)cmd.flags, state);
+        continue;
+      }
+      if (cmd.type == IOCmdType::Fill) {
+        auto &dst = std::get<RawDataDesc>(cmd.dst);
+        IOLooper::EnqueueMemRequest(dst.data.data(), nullptr, dst.data.size(),
+                                    cmd.flags, IOStatus::Success, state);
+        continue;
+      }
+      if (cmd.type != IOCmdType::Copy) {
+        IOLooper::EnqueueMetaRequest(cmd, state);
+        continue;
+      }
       std::visit(
           [&](auto &&src, auto &&dst) {
             if constexpr (std::is_same_v<std::decay_t<decltype(src)>,
@@ -223,31 +1895,36 @@ private:
               if constexpr (std::is_same_v<std::decay_t<decltype(dst)>,
                                            FileDesc>) {
                 IOLooper::EnqueueRequest(src.handle, src.offset, src.size,
-                                         dst.handle, dst.offset, dst.size);
+                                         dst.handle, dst.offset, dst.size,
+                                         state);
               } else {
                 IOLooper::EnqueueRequest(src.handle, src.offset,
-                                         dst.data.data(), dst.data.size());
+                                         dst.data.data(), dst.data.size(),
+                                         state);
               }
             } else {
               if constexpr (std::is_same_v<std::decay_t<decltype(dst)>,
                                            FileDesc>) {
                 IOLooper::EnqueueRequest(src.data.data(), src.data.size(),
-                                         dst.handle, dst.offset);
+                                         dst.handle, dst.offset, state);
               } else {
-                SPDLOG_ERROR("Invalid command");
+                size_t size = std::min(src.data.size(), dst.data.size());
+                IOLooper::EnqueueMemRequest(
+                    dst.data.data(), src.data.data(), size, 0,
+                    size < src.data.size() ? IOStatus::ShortTransfer
+                                           : IOStatus::Success,
+                    state);
               }
             }
           },
           cmd.src, cmd.dst);
     }
-
-    IOLooper::EnqueueSignal(&event, cmd_holder.time_stamp);
   }
 };
 struct IOService::Impl {
   std::jthread *thread;
   IOHandler handler;
-  bool requested_exit = false;
+  std::atomic_bool requested_exit = false;
   static IOService::Impl &Get() {
     static IOService::Impl impl;
     return impl;
@@ -262,14 +1939,21 @@ struct IOService::Impl {
   }
   Impl() {
     IOLooper::Init();
+    handler.event.OpenNotifyHandle();
     thread = new std::jthread([this]() { WorkLoop(); });
   }
   void Dispose() {
     requested_exit = true;
     delete thread;
+    handler.StopReplay();
     IOLooper::Dispose();
+    handler.event.CloseNotifyHandle();
   }
   void Sync(uint64_t time_stamp) { handler.event.Wait(time_stamp); }
+  IOStatus Sync(uint64_t time_stamp, std::chrono::nanoseconds timeout) {
+    return handler.event.Wait(time_stamp, timeout) ? IOStatus::Success
+                                                   : IOStatus::Timeout;
+  }
 };
 
 void IOService::Init() { IOService::Impl::Get(); }
@@ -277,7 +1961,61 @@ void IOService::Dispose() { IOService::Impl::Get().Dispose(); }
 void IOService::Sync(uint64_t time_stamp) {
   IOService::Impl::Get().Sync(time_stamp);
 }
+IOStatus IOService::Sync(uint64_t time_stamp,
+                        std::chrono::nanoseconds timeout) {
+  return IOService::Impl::Get().Sync(time_stamp, timeout);
+}
+std::vector<file_handle> IOCommandList::ResolveFileHandles(
+    std::span<const std::filesystem::path> paths) {
+  std::vector<file_handle> handles;
+  handles.reserve(paths.size());
+  auto &files = Storage().files;
+  for (auto &path : paths) {
+    handles.push_back(
+        PathTable::Get().Intern(path.lexically_normal().string()));
+    files.push_back(handles.back());
+  }
+  IOLooper::EnqueuePrefetch(std::vector<file_handle>(handles));
+  return handles;
+}
+
+void IOService::SetCopyChunkSize(size_t size) {
+  IOLooper::SetCopyChunkSize(size);
+}
+void IOService::SetGroupCommitWindow(
+    std::optional<std::chrono::microseconds> window) {
+  IOLooper::SetGroupCommitWindow(window);
+}
+void IOService::SetReadSharing(bool enabled) {
+  IOService::Impl::Get().handler.SetReadSharing(enabled);
+}
+void IOService::SetBlockCacheBudget(size_t budget) {
+  BlockCache::Get().SetBudget(budget);
+}
+void IOService::SetReadAheadLimit(uint64_t size) {
+  IOLooper::SetReadAheadLimit(size);
+}
+void IOService::StartTraceRecording() {
+  IOService::Impl::Get().handler.StartTraceRecording();
+}
+AccessTrace IOService::StopTraceRecording() {
+  return IOService::Impl::Get().handler.StopTraceRecording();
+}
+void IOService::ReplayTrace(const AccessTrace &trace) {
+  IOService::Impl::Get().handler.ReplayTrace(trace);
+}
+uint64_t IOService::GetCompletedValue() {
+  return IOService::Impl::Get().handler.event.GetCompletedValue();
+}
+int IOService::GetCompletionFd() {
+  return IOService::Impl::Get().handler.event.notify_fd;
+}
 uint64_t IOService::Execute(IOCommandList &cmd_list) {
   return IOService::Impl::Get().handler.EnqueueCmds(cmd_list);
 }
+uint64_t IOService::Execute(const IOCommandBundle &bundle,
+                            IOCallBack &&callback) {
+  return IOService::Impl::Get().handler.EnqueueCmds(bundle,
+                                                    std::move(callback));
+}
 } // namespace John
\ No newline at end of file
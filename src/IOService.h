@@ -1,50 +1,250 @@
 #pragma once
+#include "AccessTrace.h"
+#include "Compression.h"
+#include "PathTable.h"
+#include "misc/arena.h"
+#include "misc/function.h"
 #include "misc/traits.h"
 #include "misc/utils.h"
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <span>
 #include <thread>
 #include <variant>
 #include <vector>
 
 namespace John {
-struct file_handle {
-  void *file = nullptr;
-  size_t length = 0;
-};
 struct FileDesc {
   file_handle handle;
-  uint32_t offset;
-  uint32_t size;
+  uint64_t offset = 0;
+  uint64_t size = 0;
 };
 
 struct RawDataDesc {
   std::span<uint8_t> data;
 };
 using CmdTarget = std::variant<FileDesc, RawDataDesc>;
+enum class IOStatus : uint32_t {
+  Success,
+  Timeout,
+  OpenFailed,
+  // fewer bytes than requested were transferred, e.g. read past end of file
+  ShortTransfer,
+  Failed,
+  InvalidCommand,
+  // the file handle was released since it was resolved
+  InvalidHandle,
+  NotFound,
+  AlreadyExists,
+  // the data read does not match IOCmdOptions::expected_checksum
+  ChecksumMismatch,
+  // a compressed payload failed to decode
+  CorruptData,
+};
+// completion record of a single command
+struct IOResult {
+  IOStatus status = IOStatus::Success;
+  size_t bytes = 0;
+  // from IOService::Execute to completion, queueing included
+  std::chrono::nanoseconds latency{0};
+  // hash of the bytes read when IOCmdOptions::checksum is set
+  uint64_t checksum = 0;
+};
+struct IOCompletion {
+  uint64_t user_data;
+  uint64_t time_stamp;
+  IOResult result;
+};
+
+// Single producer (the IOService thread), single consumer ring of command
+// completions, drained by the application instead of running callbacks on the
+// IOService thread. Must outlive every list that posts to it.
+class IOCompletionQueue {
+  friend struct IOHandler;
+  friend struct IOCmdState;
+  std::unique_ptr<IOCompletion[]> ring;
+  size_t mask;
+  alignas(64) std::atomic_size_t head = 0;
+  alignas(64) std::atomic_size_t tail = 0;
+  // producer only, completions that did not fit into the ring
+  std::deque<IOCompletion> overflow;
+
+  bool Push(const IOCompletion &completion) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+    ring[t & mask] = completion;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+  void Post(const IOCompletion &completion) {
+    if (!overflow.empty() || !Push(completion)) {
+      overflow.push_back(completion);
+    }
+  }
+  // returns true if completions are still waiting for space
+  bool FlushOverflow() {
+    while (!overflow.empty() && Push(overflow.front())) {
+      overflow.pop_front();
+    }
+    return !overflow.empty();
+  }
+
+public:
+  explicit IOCompletionQueue(size_t capacity = 256) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    ring = std::make_unique<IOCompletion[]>(size);
+    mask = size - 1;
+  }
+  // contiguous completions ready for the consumer, may be fewer than are
+  // available when the ring wraps around
+  std::span<const IOCompletion> PeekCompletions() const {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t count = std::min(t - h, mask + 1 - (h & mask));
+    return {ring.get() + (h & mask), count};
+  }
+  void ConsumeCompletions(size_t count) {
+    head.store(head.load(std::memory_order_relaxed) + count,
+               std::memory_order_release);
+  }
+};
+
+using IOCmdCallBack = MoveFunction<void(const IOResult &)>;
+// In order: callbacks of a list fire once it and every list executed before
+// it have completed. Out of order: command callbacks fire as soon as their
+// own command completes and list callbacks once the list has completed. The
+// timeline advances in order either way.
+enum class IOCompletionOrder : uint32_t {
+  InOrder,
+  OutOfOrder,
+};
+enum class IOChecksum : uint32_t {
+  None,
+  // CRC-32C, hardware accelerated with SSE4.2
+  Crc32c,
+  // 64 bit XXH3, seed 0
+  Xxh3,
+};
+struct IOCmdOptions {
+  // zero means no deadline, otherwise measured from IOService::Execute
+  std::chrono::milliseconds timeout{0};
+  // optional, written before the timeline of the list is signaled
+  IOResult *result = nullptr;
+  // fired on the IOService thread, before the callbacks of the list
+  IOCmdCallBack callback;
+  // passed through to the completion queue of the list
+  uint64_t user_data = 0;
+  // Reads of a file into memory hash each chunk right after reading it, while
+  // it is still in cache. The hash is returned in IOResult::checksum. Memory
+  // copies hash the copied bytes, ReadCompressed the payload as stored.
+  IOChecksum checksum = IOChecksum::None;
+  // a read with a different hash completes with ChecksumMismatch
+  std::optional<uint64_t> expected_checksum;
+
+  // callbacks are move-only, everything else is copied
+  IOCmdOptions WithoutCallback() const {
+    return {timeout, result, nullptr, user_data, checksum, expected_checksum};
+  }
+};
+enum class IOCmdType : uint32_t {
+  Copy,
+  Stat,
+  Open,
+  Close,
+  Unlink,
+  Rename,
+  MakeDir,
+  Flush,
+  Allocate,
+  Truncate,
+  PunchHole,
+  Fill,
+  Decompress,
+  Compress,
+};
+enum class IOFlushMode : uint32_t {
+  // fsync, data and metadata
+  Full,
+  // fdatasync, data and the metadata needed to read it back
+  Data,
+  // sync_file_range, writeback of the range only, not a durability guarantee
+  Range,
+};
+enum IOOpenFlags : uint32_t {
+  IO_OPEN_WRITE = 1 << 0,
+  // create and truncate imply write
+  IO_OPEN_CREATE = 1 << 1,
+  IO_OPEN_TRUNCATE = 1 << 2,
+};
 struct IOCmd {
   CmdTarget src;
   CmdTarget dst;
   uint32_t flags;
+  IOCmdOptions options;
+  IOCmdType type = IOCmdType::Copy;
+  // written by Stat commands
+  FileMetadata *metadata = nullptr;
+
+  IOCmd CopyWithoutCallback() const {
+    return {src, dst, flags, options.WithoutCallback(), type, metadata};
+  }
 };
-using IOCallBack = std::function<void(void)>;
+// receives one result per command, in recording order
+using IOCallBack = MoveFunction<void(std::span<const IOResult>)>;
 struct Event {
   std::atomic_int64_t timeline;
+  // pollable handle that becomes readable when the timeline advances, -1 when
+  // not opened or unsupported on the platform
+  int notify_fd = -1;
+  void OpenNotifyHandle();
+  void CloseNotifyHandle();
   void Wait(uint64_t timeline) {
-    while (this->timeline.load(std::memory_order_relaxed) < timeline) {
+    while (!IsSignaled(timeline)) {
       std::this_thread::yield();
     }
   }
+  // Returns false if the timeline was not reached before the timeout. The
+  // commands keep running then, every buffer they use has to stay valid
+  // until the timeline is reached after all.
+  bool Wait(uint64_t timeline, std::chrono::nanoseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!IsSignaled(timeline)) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
+      std::this_thread::yield();
+    }
+    return true;
+  }
   void Signal(uint64_t timeline) {
-    if (timeline > this->timeline.load(std::memory_order_relaxed))
-      this->timeline.store(timeline, std::memory_order_relaxed);
+    if (!IsSignaled(timeline)) {
+      this->timeline.store(timeline, std::memory_order_release);
+      Notify();
+    }
   }
   bool IsSignaled(uint64_t timeline) {
-    return this->timeline.load(std::memory_order_relaxed) >= timeline;
+    return (uint64_t)this->timeline.load(std::memory_order_acquire) >=
+           timeline;
   }
+  uint64_t GetCompletedValue() {
+    return this->timeline.load(std::memory_order_acquire);
+  }
+
+private:
+  void Notify();
 };
 
 struct IOService {
@@ -52,40 +252,310 @@ struct IOService {
   static void Dispose();
 
   static uint64_t Execute(class IOCommandList &cmd_list);
+  // the bundle is left untouched and may be patched and executed again
+  static uint64_t Execute(const class IOCommandBundle &bundle,
+                          IOCallBack &&callback = {});
   static void Sync(uint64_t time_stamp);
+  // Returns Timeout if the list did not complete in time. Its commands are
+  // not cancelled and keep writing to the buffers and results of the list,
+  // which have to stay valid until the time stamp completes.
+  static IOStatus Sync(uint64_t time_stamp, std::chrono::nanoseconds timeout);
+  // latest time stamp whose list and every list before it have completed
+  static uint64_t GetCompletedValue();
+  // Non-blocking eventfd that becomes readable whenever the completed value
+  // advances, for epoll based loops. Read it to rearm, then query
+  // GetCompletedValue. Returns -1 where eventfd is unavailable.
+  static int GetCompletionFd();
+  // File to file copies are split into chunks of this size that run in
+  // parallel on the backend workers, 16 MiB by default. A copy still
+  // completes as one command.
+  static void SetCopyChunkSize(size_t size);
+  // Group commit merges Full and Data flushes of the same file from
+  // concurrent lists into one syscall. Flushes are held back for at most the
+  // window, zero merges only flushes that are already queued. Disabled by
+  // default, nullopt disables it again.
+  static void
+  SetGroupCommitWindow(std::optional<std::chrono::microseconds> window);
+  // Reads into memory that continue where the previous read of the file
+  // ended are followed by asynchronous read-ahead on the backend workers,
+  // later reads are served from it. The window adapts per file up to this
+  // size, 4 MiB by default, zero disables read-ahead.
+  static void SetReadAheadLimit(uint64_t size);
+  // Caches blocks of files read into memory, up to budget bytes, see
+  // BlockCache. Reads the cache holds completely complete inline when their
+  // list is executed, possibly before commands of earlier lists that are
+  // still running. Reads that request a checksum always go to the file.
+  // Disabled by default, zero disables it again.
+  static void SetBlockCacheBudget(size_t budget);
+  // A read into memory whose range lies within a read of the same file that
+  // is still queued or running on the backend attaches to it instead of
+  // reading again. It completes together with that read, possibly before
+  // commands of its own list recorded earlier. If that read fails, the
+  // attached reads are read again on their own. Reads with a timeout and
+  // reads after a command changing the file are never shared. Enabled by
+  // default.
+  static void SetReadSharing(bool enabled);
+  // Records the file side of every command executed from now on. Restarting
+  // discards the accesses recorded so far.
+  static void StartTraceRecording();
+  // stops recording and returns the accesses, empty if none was started
+  static AccessTrace StopTraceRecording();
+  // Prefetches the reads of a recorded trace, typically one of the previous
+  // run, see TracePrefetcher. Replaces a replay that is still running.
+  static void ReplayTrace(const AccessTrace &trace);
   struct Impl;
 };
 
+// Arena backed storage of a recorded list. It travels with the list into
+// IOService::Execute and is recycled as a whole once the batch retires.
+struct IOCmdStorage {
+  Arena arena;
+  std::pmr::vector<IOCmd> cmds{&arena};
+  std::pmr::vector<IOCallBack> callbacks{&arena};
+  // files the list expects to exist, checked by IOCommandBundle
+  std::pmr::vector<file_handle> files{&arena};
+
+  void Reset() {
+    // drop the buffers before the arena hands their memory out again
+    cmds = std::pmr::vector<IOCmd>(&arena);
+    callbacks = std::pmr::vector<IOCallBack>(&arena);
+    files = std::pmr::vector<file_handle>(&arena);
+    arena.Reset();
+  }
+  struct Recycler {
+    void operator()(IOCmdStorage *storage) const;
+  };
+  static std::unique_ptr<IOCmdStorage, Recycler> Acquire();
+};
+using IOCmdStoragePtr = std::unique_ptr<IOCmdStorage, IOCmdStorage::Recycler>;
+
 class IOCommandList {
   friend struct IOHandler;
-  std::vector<IOCmd> cmds;
-  std::vector<IOCallBack> callbacks;
-  std::vector<file_handle> files;
+  friend class IOCommandBundle;
+  IOCmdStoragePtr storage;
+  bool out_of_order = false;
+  IOCompletionQueue *completion_queue = nullptr;
+
+  IOCmdStorage &Storage() {
+    if (!storage) {
+      storage = IOCmdStorage::Acquire();
+    }
+    return *storage;
+  }
+  size_t Record(IOCmd &&cmd) {
+    auto &cmds = Storage().cmds;
+    cmds.push_back(std::move(cmd));
+    return cmds.size() - 1;
+  }
 
 public:
-  void CopyFrom(const FileDesc &src, const RawDataDesc &dst) {
-    cmds.push_back({src, dst, 0});
+  // each CopyFrom returns the index of the recorded command
+  size_t CopyFrom(const FileDesc &src, const RawDataDesc &dst,
+                  IOCmdOptions options = {}) {
+    return Record({src, dst, 0, std::move(options)});
+  }
+  size_t CopyFrom(const RawDataDesc &src, const FileDesc &dst,
+                  IOCmdOptions options = {}) {
+    return Record({src, dst, 0, std::move(options)});
+  }
+  // a smaller destination range is a ShortTransfer
+  size_t CopyFrom(const FileDesc &src, const FileDesc &dst,
+                  IOCmdOptions options = {}) {
+    return Record({src, dst, 0, std::move(options)});
+  }
+  // Memory commands run on the backend workers in list order, e.g. moving a
+  // staging buffer into place after the read that filled it. The buffers
+  // must not overlap, a smaller destination is a ShortTransfer.
+  size_t CopyFrom(const RawDataDesc &src, const RawDataDesc &dst,
+                  IOCmdOptions options = {}) {
+    return Record({src, dst, 0, std::move(options)});
+  }
+  // Reads the compressed payload in src (see CompressedHeader) into an
+  // internal staging buffer and decodes its blocks into dst in parallel on
+  // the backend workers. The looper moves on to the next reads meanwhile,
+  // later commands of the same list still wait for the decoded data. dst
+  // must hold the raw size, which is reported in IOResult::bytes.
+  size_t ReadCompressed(const FileDesc &src, const RawDataDesc &dst,
+                        IOCmdOptions options = {}) {
+    return Record({src, dst, 0, std::move(options), IOCmdType::Decompress});
+  }
+  // Compresses src in independent blocks in parallel on the backend workers
+  // and writes the payload, readable by ReadCompressed, at dst.offset.
+  // dst.size is ignored, the written size is reported in IOResult::bytes.
+  size_t WriteCompressed(const RawDataDesc &src, const FileDesc &dst,
+                         CompressionCodec codec, IOCmdOptions options = {}) {
+    return Record({src, dst, (uint32_t)codec, std::move(options),
+                   IOCmdType::Compress});
+  }
+  // repeats the 4 bytes of pattern in memory order over dst
+  size_t Fill(const RawDataDesc &dst, uint32_t pattern,
+              IOCmdOptions options = {}) {
+    return Record({dst, dst, pattern, std::move(options), IOCmdType::Fill});
+  }
+
+  // Metadata commands run on the same timeline as copies. Commands of a list
+  // execute in recording order, so e.g. writing a temporary file and
+  // renaming it over the destination can be one list.
+  size_t Stat(file_handle file, FileMetadata *metadata,
+              IOCmdOptions options = {}) {
+    return Record({FileDesc{file}, FileDesc{file}, 0, std::move(options),
+                   IOCmdType::Stat, metadata});
+  }
+  // opens the file ahead of later commands, see IOOpenFlags
+  size_t Open(file_handle file, uint32_t open_flags = 0,
+              IOCmdOptions options = {}) {
+    return Record({FileDesc{file}, FileDesc{file}, open_flags,
+                   std::move(options), IOCmdType::Open});
+  }
+  // drops the cached descriptors of the file
+  size_t Close(file_handle file, IOCmdOptions options = {}) {
+    return Record({FileDesc{file}, FileDesc{file}, 0, std::move(options),
+                   IOCmdType::Close});
+  }
+  // Handles to a removed path go stale, later commands using them complete
+  // with InvalidHandle. Resolve the path again to create it anew.
+  size_t Unlink(file_handle file, IOCmdOptions options = {}) {
+    return Record({FileDesc{file}, FileDesc{file}, 0, std::move(options),
+                   IOCmdType::Unlink});
+  }
+  // replaces an existing destination, handles to the source go stale as
+  // with Unlink
+  size_t Rename(file_handle from, file_handle to, IOCmdOptions options = {}) {
+    return Record({FileDesc{from}, FileDesc{to}, 0, std::move(options),
+                   IOCmdType::Rename});
+  }
+  size_t MakeDir(file_handle dir, IOCmdOptions options = {}) {
+    return Record({FileDesc{dir}, FileDesc{dir}, 0, std::move(options),
+                   IOCmdType::MakeDir});
   }
-  void CopyFrom(const RawDataDesc &src, const FileDesc &dst) {
-    cmds.push_back({src, dst, 0});
+  // completes once earlier writes to the file are durable, later commands
+  // of the list run after that
+  size_t Flush(file_handle file, IOFlushMode mode = IOFlushMode::Full,
+               IOCmdOptions options = {}) {
+    return Record({FileDesc{file}, FileDesc{file}, (uint32_t)mode,
+                   std::move(options), IOCmdType::Flush});
   }
-  void CopyFrom(const FileDesc &src, const FileDesc &dst) {
-    cmds.push_back({src, dst, 0});
+  size_t FlushRange(const FileDesc &range, IOCmdOptions options = {}) {
+    return Record({range, range, (uint32_t)IOFlushMode::Range,
+                   std::move(options), IOCmdType::Flush});
   }
-  void AddCallback(IOCallBack &&callback) {
-    callbacks.push_back(std::move(callback));
+  // Allocate reserves the blocks of the range up front, so that a later
+  // fan-out of writes does not fragment the file or grow it piecewise. It
+  // extends the file to cover the range, an existing file is required.
+  size_t Allocate(const FileDesc &range, IOCmdOptions options = {}) {
+    return Record({range, range, 0, std::move(options), IOCmdType::Allocate});
+  }
+  size_t Truncate(file_handle file, uint64_t size, IOCmdOptions options = {}) {
+    return Record({FileDesc{file, 0, size}, FileDesc{file, 0, size}, 0,
+                   std::move(options), IOCmdType::Truncate});
+  }
+  // deallocates the range without changing the file size, it reads as zeros
+  size_t PunchHole(const FileDesc &range, IOCmdOptions options = {}) {
+    return Record(
+        {range, range, 0, std::move(options), IOCmdType::PunchHole});
+  }
+  void SetCompletionOrder(IOCompletionOrder order) {
+    out_of_order = order == IOCompletionOrder::OutOfOrder;
+  }
+  // every command of the list posts an IOCompletion, following the
+  // completion order of the list
+  void SetCompletionQueue(IOCompletionQueue *queue) {
+    completion_queue = queue;
+  }
+  // accepts callables taking the results of the list or no argument
+  template <typename TFunc> void AddCallback(TFunc &&callback) {
+    if constexpr (std::is_invocable_v<TFunc &, std::span<const IOResult>>) {
+      Storage().callbacks.emplace_back(std::forward<TFunc>(callback));
+    } else {
+      Storage().callbacks.emplace_back(
+          [callback = std::forward<TFunc>(callback)](
+              std::span<const IOResult>) mutable { callback(); });
+    }
+  }
+  bool Empty() const { return !storage || storage->cmds.empty(); }
+  // Drops everything recorded and the settings. The arena is kept, so a
+  // long-lived list records again without allocating.
+  void Reset() {
+    Storage().Reset();
+    out_of_order = false;
+    completion_queue = nullptr;
   }
 
+  // each unique path is interned and checked for existence once per process
   file_handle ResolveFileHandle(const std::filesystem::path &path) {
-    assert(std::filesystem::exists(path) && "File does not exist");
-    file_handle handle;
-    char *path_str = new char[path.string().size() + 1];
-    std::strcpy(path_str, path.string().c_str());
-    handle.file = path_str;
-    handle.length = path.string().size();
-    files.push_back(handle);
+    bool inserted = false;
+    auto handle =
+        PathTable::Get().Intern(path.lexically_normal().string(), &inserted);
+#ifndef NDEBUG
+    // cached metadata never expires, a file recorded as missing may have
+    // been created since and is looked up again
+    FileMetadata metadata;
+    bool cached = PathTable::Get().GetMetadata(handle, &metadata);
+    assert(((cached && metadata.exists) || (!cached && !inserted) ||
+            std::filesystem::exists(path)) &&
+           "File does not exist");
+#endif
+    Storage().files.push_back(handle);
     return handle;
   }
+  // for paths that commands of the list create, e.g. by Open or MakeDir
+  file_handle ResolveNewFileHandle(const std::filesystem::path &path) {
+    return PathTable::Get().Intern(path.lexically_normal().string());
+  }
+  // Interns every path without touching the filesystem, then opens the files
+  // and records their metadata on the IOService backend, walking each parent
+  // directory once. Commands recorded with the handles run after that.
+  std::vector<file_handle>
+  ResolveFileHandles(std::span<const std::filesystem::path> paths);
+};
+
+// A command list recorded once and executed many times. File handles are
+// resolved and validated when the bundle is created, only memory buffers are
+// patched between submissions. Command and list callbacks are not kept, pass
+// a callback to Execute or attach a completion queue instead. Each submission
+// copies the commands and the handles refer to paths interned for the whole
+// process, so the bundle may be patched or destroyed while earlier
+// submissions still run.
+class IOCommandBundle {
+  friend struct IOHandler;
+  IOCmdStoragePtr storage;
+  bool out_of_order = false;
+  IOCompletionQueue *completion_queue = nullptr;
+  bool valid = true;
+
+public:
+  explicit IOCommandBundle(IOCommandList &&cmd_list)
+      : out_of_order(cmd_list.out_of_order),
+        completion_queue(cmd_list.completion_queue) {
+    cmd_list.Storage();
+    storage = std::move(cmd_list.storage);
+    storage->callbacks.clear();
+    for (auto &cmd : storage->cmds) {
+      cmd.options.callback = nullptr;
+    }
+    for (auto &file : storage->files) {
+      auto *path = PathTable::Get().Path(file);
+      valid = valid && path && std::filesystem::exists(path);
+    }
+  }
+  // false if any file was missing when the bundle was created, paths from
+  // ResolveNewFileHandle are not checked
+  bool IsValid() const { return valid; }
+  size_t Size() const { return storage->cmds.size(); }
+  // replaces the memory side of a recorded command, the size may change
+  void SetBuffer(size_t cmd_index, const RawDataDesc &data) {
+    auto &cmd = storage->cmds[cmd_index];
+    if (std::holds_alternative<RawDataDesc>(cmd.dst)) {
+      cmd.dst = data;
+    } else {
+      assert(std::holds_alternative<RawDataDesc>(cmd.src) &&
+             "Command has no memory buffer");
+      cmd.src = data;
+    }
+  }
+  void SetResult(size_t cmd_index, IOResult *result) {
+    storage->cmds[cmd_index].options.result = result;
+  }
 };
 
 }; // namespace John
\ No newline at end of file
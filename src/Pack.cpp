@@ -0,0 +1,158 @@
+#include "Pack.h"
+#include "misc/checksum.h"
+#include <algorithm>
+#include <memory>
+#include <spdlog/spdlog.h>
+
+namespace John {
+uint64_t PackFormat::HashName(std::string_view name) {
+  return Xxh3(name.data(), name.size());
+}
+
+bool PackReader::Open(const std::filesystem::path &path) {
+  IOCommandList list;
+  auto pack = list.ResolveFileHandle(path);
+  PackHeader header{};
+  FileMetadata metadata;
+  IOResult results[2];
+  list.Stat(pack, &metadata, {.result = &results[0]});
+  list.CopyFrom(FileDesc{pack, 0, sizeof(header)},
+                RawDataDesc{std::span((uint8_t *)&header, sizeof(header))},
+                {.result = &results[1]});
+  IOService::Sync(IOService::Execute(list));
+  if (results[0].status != IOStatus::Success ||
+      results[1].status != IOStatus::Success ||
+      header.magic != PackFormat::MAGIC ||
+      header.version != PackFormat::VERSION) {
+    SPDLOG_ERROR("{} is not a pack file", path.string());
+    return false;
+  }
+  // the TOC has to fit between the header and the end of the file, which
+  // also keeps its size from overflowing
+  if (header.entry_count > metadata.size / sizeof(PackEntry) ||
+      header.toc_offset < sizeof(header) ||
+      header.toc_offset >
+          metadata.size - header.entry_count * sizeof(PackEntry)) {
+    SPDLOG_ERROR("Truncated pack file {}", path.string());
+    return false;
+  }
+  std::vector<PackEntry> entries(header.entry_count);
+  size_t toc_size = entries.size() * sizeof(PackEntry);
+  IOResult result;
+  list.CopyFrom(FileDesc{pack, header.toc_offset, toc_size},
+                RawDataDesc{std::span((uint8_t *)entries.data(), toc_size)},
+                {.result = &result});
+  IOService::Sync(IOService::Execute(list));
+  auto outside_data = [&](const PackEntry &entry) {
+    return entry.offset < sizeof(header) ||
+           entry.offset > header.toc_offset ||
+           entry.stored_size > header.toc_offset - entry.offset;
+  };
+  if (result.status != IOStatus::Success ||
+      !std::is_sorted(entries.begin(), entries.end(),
+                      [](const PackEntry &lhs, const PackEntry &rhs) {
+                        return lhs.name_hash < rhs.name_hash;
+                      }) ||
+      std::any_of(entries.begin(), entries.end(), outside_data)) {
+    SPDLOG_ERROR("Invalid table of contents in {}", path.string());
+    return false;
+  }
+  handle = pack;
+  toc = std::move(entries);
+  return true;
+}
+
+const PackEntry *PackReader::Find(std::string_view name) const {
+  uint64_t hash = PackFormat::HashName(name);
+  auto iter = std::lower_bound(
+      toc.begin(), toc.end(), hash,
+      [](const PackEntry &entry, uint64_t hash) {
+        return entry.name_hash < hash;
+      });
+  return iter != toc.end() && iter->name_hash == hash ? &*iter : nullptr;
+}
+
+size_t PackReader::Read(IOCommandList &list, std::span<PackRead> reads) const {
+  struct Pending {
+    const PackEntry *entry;
+    PackRead *read;
+  };
+  std::vector<Pending> pending;
+  pending.reserve(reads.size());
+  for (auto &read : reads) {
+    auto *entry = Find(read.name);
+    if (!entry || read.dst.data.size() < entry->raw_size) {
+      if (read.options.result) {
+        *read.options.result = {entry ? IOStatus::ShortTransfer
+                                      : IOStatus::NotFound};
+      }
+      continue;
+    }
+    pending.push_back({entry, &read});
+  }
+  std::stable_sort(pending.begin(), pending.end(),
+                   [](const Pending &lhs, const Pending &rhs) {
+                     if (lhs.read->priority != rhs.read->priority) {
+                       return lhs.read->priority > rhs.read->priority;
+                     }
+                     return lhs.entry->offset < rhs.entry->offset;
+                   });
+  auto options = [&](const Pending &item) {
+    IOCmdOptions options = std::move(item.read->options);
+    if (verify_checksums) {
+      options.checksum = IOChecksum::Xxh3;
+      options.expected_checksum = item.entry->checksum;
+    }
+    return options;
+  };
+  auto coalescable = [&](const Pending &item) {
+    return verify_checksums && !(item.entry->flags & PACK_ENTRY_COMPRESSED);
+  };
+  for (size_t i = 0; i < pending.size();) {
+    auto &first = pending[i];
+    auto *entry = first.entry;
+    if (entry->flags & PACK_ENTRY_COMPRESSED) {
+      list.ReadCompressed(FileDesc{handle, entry->offset, entry->stored_size},
+                          first.read->dst, options(first));
+      ++i;
+      continue;
+    }
+    // extend the run while the next entry is close behind the previous one
+    size_t last = i + 1;
+    uint64_t end = entry->offset + entry->stored_size;
+    while (coalescable(first) && last < pending.size() &&
+           coalescable(pending[last]) &&
+           pending[last].read->priority == first.read->priority) {
+      auto *next = pending[last].entry;
+      uint64_t next_end = next->offset + next->stored_size;
+      if (next->offset < end || next->offset - end > MAX_COALESCE_GAP ||
+          next_end - entry->offset > MAX_COALESCED_SIZE) {
+        break;
+      }
+      end = next_end;
+      ++last;
+    }
+    if (last == i + 1) {
+      list.CopyFrom(FileDesc{handle, entry->offset, entry->stored_size},
+                    RawDataDesc{first.read->dst.data.first(entry->raw_size)},
+                    options(first));
+      ++i;
+      continue;
+    }
+    size_t size = end - entry->offset;
+    auto staging = std::make_unique<uint8_t[]>(size);
+    list.CopyFrom(FileDesc{handle, entry->offset, size},
+                  RawDataDesc{std::span(staging.get(), size)});
+    for (; i < last; ++i) {
+      auto *part = pending[i].entry;
+      auto src = std::span(staging.get() + (part->offset - entry->offset),
+                           part->stored_size);
+      auto dst = pending[i].read->dst.data.first(part->raw_size);
+      list.CopyFrom(RawDataDesc{src}, RawDataDesc{dst}, options(pending[i]));
+    }
+    // the staging buffer lives until the list completed
+    list.AddCallback([staging = std::move(staging)]() {});
+  }
+  return pending.size();
+}
+} // namespace John
@@ -0,0 +1,86 @@
+#pragma once
+#include "IOService.h"
+#include <filesystem>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace John {
+// Pack files hold many assets in one file. Layout, little endian:
+//   PackHeader
+//   entry data, every entry starting at a PackFormat::ALIGNMENT boundary
+//   PackEntry toc[entry_count], sorted by name_hash
+struct PackHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t entry_count;
+  uint64_t toc_offset;
+  uint64_t reserved;
+};
+static_assert(sizeof(PackHeader) == 32);
+
+enum PackEntryFlags : uint32_t {
+  // stored as a compressed payload, see CompressedHeader
+  PACK_ENTRY_COMPRESSED = 1 << 0,
+};
+struct PackEntry {
+  uint64_t name_hash;
+  uint64_t offset;
+  // bytes in the pack
+  uint64_t stored_size;
+  // bytes after decompression
+  uint64_t raw_size;
+  // Xxh3 of the stored bytes
+  uint64_t checksum;
+  uint32_t flags;
+  uint32_t reserved;
+};
+static_assert(sizeof(PackEntry) == 48);
+
+struct PackFormat {
+  // "JPAK"
+  static constexpr uint32_t MAGIC = 0x4b41504a;
+  static constexpr uint32_t VERSION = 1;
+  static constexpr uint64_t ALIGNMENT = 4096;
+  // Xxh3 of the name, names are not stored
+  static uint64_t HashName(std::string_view name);
+};
+
+struct PackRead {
+  std::string_view name;
+  // must hold the raw size of the entry
+  RawDataDesc dst;
+  // higher priorities are recorded, and therefore read, first
+  int32_t priority = 0;
+  // the checksum fields are filled in by the reader
+  IOCmdOptions options;
+};
+
+// Looks up entries of a pack by name and records their reads into command
+// lists. Neighbouring small entries are coalesced into one read that is
+// split by memory copies afterwards.
+class PackReader {
+  file_handle handle;
+  std::vector<PackEntry> toc;
+  bool verify_checksums = true;
+
+public:
+  // entries closer than this are read together
+  static constexpr uint64_t MAX_COALESCE_GAP = 64 * 1024;
+  static constexpr uint64_t MAX_COALESCED_SIZE = 4 * 1024 * 1024;
+
+  // reads the header and the TOC through IOService, blocks until done
+  bool Open(const std::filesystem::path &path);
+  bool IsOpen() const { return handle.generation != 0; }
+  size_t Size() const { return toc.size(); }
+  const PackEntry *Find(std::string_view name) const;
+  // Checksum verification is on by default. Coalescing relies on it to
+  // attribute a failed shared read to the entries, without it every entry is
+  // read on its own.
+  void SetVerifyChecksums(bool verify) { verify_checksums = verify; }
+  // Records the reads sorted by priority, then by offset. Reads of unknown
+  // names or into too small buffers are not recorded, their result is set
+  // right away. Returns the number of recorded reads.
+  size_t Read(IOCommandList &list, std::span<PackRead> reads) const;
+};
+} // namespace John
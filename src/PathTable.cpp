@@ -0,0 +1,109 @@
+#include "PathTable.h"
+
+namespace John {
+PathTable::PathTable() { ids.reserve(4096); }
+PathTable::~PathTable() {
+  for (auto &chunk : chunks) {
+    delete[] chunk.load(std::memory_order_relaxed);
+  }
+}
+
+PathTable &PathTable::Get() {
+  static PathTable table;
+  return table;
+}
+
+file_handle PathTable::Intern(std::string_view path, bool *inserted) {
+  std::lock_guard<std::mutex> lk(mutex);
+  auto iter = ids.find(path);
+  bool found = iter != ids.end();
+  uint32_t index;
+  if (found) {
+    index = iter->second;
+  } else {
+    index = count;
+    uint32_t chunk_index = index >> CHUNK_BITS;
+    if (chunk_index >= MAX_CHUNKS) {
+      return {};
+    }
+    if (!chunks[chunk_index].load(std::memory_order_relaxed)) {
+      chunks[chunk_index].store(new Entry[CHUNK_SIZE],
+                                std::memory_order_release);
+    }
+    auto *chunk = chunks[chunk_index].load(std::memory_order_relaxed);
+    chunk[index & (CHUNK_SIZE - 1)].path = path;
+    ids.emplace(std::string(path), index);
+    ++count;
+  }
+  if (inserted) {
+    *inserted = !found;
+  }
+  auto *chunk = chunks[index >> CHUNK_BITS].load(std::memory_order_relaxed);
+  return {index, chunk[index & (CHUNK_SIZE - 1)].generation.load(
+                     std::memory_order_acquire)};
+}
+
+const PathTable::Entry *PathTable::Find(file_handle handle) const {
+  uint32_t chunk_index = handle.index >> CHUNK_BITS;
+  if (handle.generation == 0 || chunk_index >= MAX_CHUNKS) {
+    return nullptr;
+  }
+  auto *chunk = chunks[chunk_index].load(std::memory_order_acquire);
+  if (!chunk) {
+    return nullptr;
+  }
+  auto &entry = chunk[handle.index & (CHUNK_SIZE - 1)];
+  if (entry.generation.load(std::memory_order_acquire) != handle.generation) {
+    return nullptr;
+  }
+  return &entry;
+}
+
+const char *PathTable::Path(file_handle handle) const {
+  auto *entry = Find(handle);
+  return entry ? entry->path.c_str() : nullptr;
+}
+
+bool PathTable::GetMetadata(file_handle handle, FileMetadata *metadata) const {
+  auto *entry = Find(handle);
+  if (!entry) {
+    return false;
+  }
+  auto state = entry->metadata.load(std::memory_order_acquire);
+  if (state == METADATA_UNKNOWN) {
+    return false;
+  }
+  metadata->exists = state != METADATA_MISSING;
+  metadata->is_regular = state == METADATA_FILE;
+  metadata->size = entry->size.load(std::memory_order_relaxed);
+  return true;
+}
+
+void PathTable::SetMetadata(file_handle handle, const FileMetadata &metadata) {
+  if (auto *entry = const_cast<Entry *>(Find(handle))) {
+    entry->size.store(metadata.size, std::memory_order_relaxed);
+    entry->metadata.store(!metadata.exists       ? METADATA_MISSING
+                          : metadata.is_regular ? METADATA_FILE
+                                                : METADATA_OTHER,
+                          std::memory_order_release);
+  }
+}
+
+void PathTable::InvalidateMetadata(file_handle handle) {
+  if (auto *entry = const_cast<Entry *>(Find(handle))) {
+    entry->metadata.store(METADATA_UNKNOWN, std::memory_order_release);
+  }
+}
+
+void PathTable::Release(file_handle handle) {
+  if (auto *entry = const_cast<Entry *>(Find(handle))) {
+    entry->size.store(0, std::memory_order_relaxed);
+    entry->metadata.store(METADATA_MISSING, std::memory_order_relaxed);
+    uint32_t generation = handle.generation;
+    // skip 0 on wrap around, it marks invalid handles
+    entry->generation.compare_exchange_strong(
+        generation, generation + 1 == 0 ? 1 : generation + 1,
+        std::memory_order_acq_rel);
+  }
+}
+} // namespace John
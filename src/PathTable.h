@@ -0,0 +1,79 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace John {
+// Generational id of an interned path. A handle goes stale once its path is
+// released, lookups through a stale handle fail instead of hitting whatever
+// the slot refers to later. Generation 0 is never handed out.
+struct file_handle {
+  uint32_t index = 0;
+  uint32_t generation = 0;
+
+  bool operator==(const file_handle &) const = default;
+};
+
+struct FileMetadata {
+  bool exists = false;
+  bool is_regular = false;
+  uint64_t size = 0;
+};
+
+// Process wide table of resolved paths. Every unique path is interned once
+// and keeps its slot, so the index is a stable key for per-file state in the
+// backend. Lookups by handle are lock free.
+class PathTable {
+  static constexpr uint32_t CHUNK_BITS = 10;
+  static constexpr uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+  static constexpr uint32_t MAX_CHUNKS = 4096;
+  enum MetadataState : uint8_t {
+    METADATA_UNKNOWN,
+    METADATA_MISSING,
+    METADATA_FILE,
+    METADATA_OTHER,
+  };
+  struct Entry {
+    std::string path;
+    std::atomic_uint32_t generation = 1;
+    std::atomic_uint64_t size = 0;
+    std::atomic_uint8_t metadata = METADATA_UNKNOWN;
+  };
+  struct PathHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view path) const noexcept {
+      return std::hash<std::string_view>{}(path);
+    }
+  };
+
+  std::array<std::atomic<Entry *>, MAX_CHUNKS> chunks{};
+  std::mutex mutex;
+  std::unordered_map<std::string, uint32_t, PathHash, std::equal_to<>> ids;
+  uint32_t count = 0;
+
+  PathTable();
+  ~PathTable();
+  const Entry *Find(file_handle handle) const;
+
+public:
+  static PathTable &Get();
+  // Inserted is set when the path was seen for the first time. Returns an
+  // invalid handle, generation 0, once the table holds MAX_CHUNKS chunks.
+  file_handle Intern(std::string_view path, bool *inserted = nullptr);
+  // null for stale handles
+  const char *Path(file_handle handle) const;
+  bool IsValid(file_handle handle) const { return Find(handle) != nullptr; }
+  // metadata cached by the backend, false if none was recorded yet
+  bool GetMetadata(file_handle handle, FileMetadata *metadata) const;
+  void SetMetadata(file_handle handle, const FileMetadata &metadata);
+  void InvalidateMetadata(file_handle handle);
+  // Invalidates every handle to the path after it was renamed or removed and
+  // records it as missing. Interning the path again hands out a new
+  // generation.
+  void Release(file_handle handle);
+};
+} // namespace John
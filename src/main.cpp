@@ -3,7 +3,7 @@
 int main(const int argc, const char **argv) {
   using namespace John;
   IOService::Init();
-  OnExitScope([]() { IOService::Dispose(); });
+  auto disposer = OnExitScope([]() { IOService::Dispose(); });
   IOCommandList cmd_list;
   std::filesystem::path src_path = argv[0];
   if (src_path.has_filename()) {
@@ -0,0 +1,78 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+namespace John {
+// Bump allocator, individual deallocations are no-ops and everything is
+// released at once by Reset, which keeps the blocks for reuse.
+class Arena final : public std::pmr::memory_resource {
+  struct Block {
+    Block *next;
+    size_t size;
+    std::byte *Data() { return reinterpret_cast<std::byte *>(this + 1); }
+  };
+  static constexpr size_t BLOCK_SIZE = 16 * 1024;
+  Block *head = nullptr;
+  Block *current = nullptr;
+  std::byte *cursor = nullptr;
+  std::byte *end = nullptr;
+  size_t capacity = 0;
+
+  void Enter(Block *block) {
+    current = block;
+    cursor = block->Data();
+    end = cursor + block->size;
+  }
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    while (true) {
+      if (cursor) {
+        size_t space = end - cursor;
+        void *ptr = cursor;
+        if (std::align(alignment, bytes, ptr, space)) {
+          cursor = static_cast<std::byte *>(ptr) + bytes;
+          return ptr;
+        }
+      }
+      if (current && current->next) {
+        Enter(current->next);
+        continue;
+      }
+      size_t size = std::max(BLOCK_SIZE, bytes + alignment);
+      auto *block = static_cast<Block *>(::operator new(sizeof(Block) + size));
+      block->next = nullptr;
+      block->size = size;
+      capacity += size;
+      if (current) {
+        current->next = block;
+      } else {
+        head = block;
+      }
+      Enter(block);
+    }
+  }
+  void do_deallocate(void *, size_t, size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() {
+    while (head) {
+      Block *next = head->next;
+      ::operator delete(head);
+      head = next;
+    }
+  }
+  void Reset() {
+    if (head) {
+      Enter(head);
+    }
+  }
+  size_t Capacity() const { return capacity; }
+};
+} // namespace John
@@ -0,0 +1,130 @@
+#include "checksum.h"
+#include <cstring>
+// XXH_INLINE_ALL makes the functions static and prefixes them with
+// XXH_INLINE_, so they don't clash with the ZSTD_ prefixed copy in zstd
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#define JOHN_CHECKSUM_X64
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define JOHN_TARGET(isa)
+#else
+#include <cpuid.h>
+#define JOHN_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace John {
+namespace {
+uint64_t ReadLE64(const uint8_t *p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// CRC-32C
+
+struct Crc32cTable {
+  uint32_t table[8][256];
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78u : 0);
+      }
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        table[k][i] =
+            (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+// slicing by 8
+uint32_t Crc32cSoftware(const uint8_t *p, size_t size, uint32_t crc) {
+  static const Crc32cTable tables;
+  auto &t = tables.table;
+  while (size >= 8) {
+    uint64_t word = ReadLE64(p) ^ crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+          t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+          t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+          t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+    p += 8;
+    size -= 8;
+  }
+  while (size--) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+#if defined(JOHN_CHECKSUM_X64)
+JOHN_TARGET("sse4.2")
+uint32_t Crc32cHardware(const uint8_t *p, size_t size, uint32_t crc) {
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    crc64 = _mm_crc32_u64(crc64, ReadLE64(p));
+    p += 8;
+    size -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (size--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+bool HasSse42() {
+  int regs[4];
+#if defined(_MSC_VER) && !defined(__clang__)
+  __cpuidex(regs, 1, 0);
+#else
+  __cpuid_count(1, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+  return regs[2] & (1 << 20);
+}
+#endif
+
+struct Kernels {
+  uint32_t (*crc32c)(const uint8_t *p, size_t size,
+                     uint32_t crc) = Crc32cSoftware;
+  Kernels() {
+#if defined(JOHN_CHECKSUM_X64)
+    if (HasSse42()) {
+      crc32c = Crc32cHardware;
+    }
+#endif
+  }
+};
+const Kernels &GetKernels() {
+  static const Kernels kernels;
+  return kernels;
+}
+} // namespace
+
+uint32_t Crc32c(const void *data, size_t size, uint32_t crc) {
+  return ~GetKernels().crc32c(static_cast<const uint8_t *>(data), size, ~crc);
+}
+
+static_assert(sizeof(XXH3_state_t) <= sizeof(Xxh3Stream) &&
+              alignof(XXH3_state_t) <= alignof(Xxh3Stream));
+
+Xxh3Stream::Xxh3Stream() {
+  XXH3_64bits_reset(reinterpret_cast<XXH3_state_t *>(state));
+}
+
+void Xxh3Stream::Update(const void *data, size_t size) {
+  XXH3_64bits_update(reinterpret_cast<XXH3_state_t *>(state), data, size);
+}
+
+uint64_t Xxh3Stream::Digest() const {
+  return XXH3_64bits_digest(reinterpret_cast<const XXH3_state_t *>(state));
+}
+
+uint64_t Xxh3(const void *data, size_t size) {
+  return XXH3_64bits(data, size);
+}
+} // namespace John
@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+namespace John {
+// CRC-32C (Castagnoli), SSE4.2 crc32 instruction when available. Pass the
+// previous result as crc to continue a running checksum.
+uint32_t Crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+// XXH3 64 bit with the default secret and seed 0, XXH3_64bits of the xxHash
+// copy vendored with zstd.
+uint64_t Xxh3(const void *data, size_t size);
+// Incremental form of Xxh3, the digest does not depend on how the input is
+// split into updates.
+class Xxh3Stream {
+  // XXH3_state_t, kept opaque so that xxhash.h stays out of this header
+  alignas(64) unsigned char state[576];
+
+public:
+  Xxh3Stream();
+  void Update(const void *data, size_t size);
+  uint64_t Digest() const;
+};
+} // namespace John
@@ -0,0 +1,110 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+namespace John {
+template <typename Signature, size_t Capacity = 48> class MoveFunction;
+
+// Move-only std::function replacement. Callables up to Capacity bytes are
+// stored inline, larger ones fall back to the heap.
+template <typename R, typename... Args, size_t Capacity>
+class MoveFunction<R(Args...), Capacity> {
+  struct VTable {
+    R (*invoke)(void *self, Args &&...args);
+    void (*move)(void *dst, void *src);
+    void (*destroy)(void *self);
+  };
+  template <typename F>
+  static constexpr bool IS_INLINE =
+      sizeof(F) <= Capacity && alignof(F) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<F>;
+
+  template <typename F> static const VTable *Table() {
+    if constexpr (IS_INLINE<F>) {
+      static constexpr VTable table{
+          [](void *self, Args &&...args) -> R {
+            return std::invoke(*static_cast<F *>(self),
+                               std::forward<Args>(args)...);
+          },
+          [](void *dst, void *src) {
+            ::new (dst) F(std::move(*static_cast<F *>(src)));
+            static_cast<F *>(src)->~F();
+          },
+          [](void *self) { static_cast<F *>(self)->~F(); }};
+      return &table;
+    } else {
+      static constexpr VTable table{
+          [](void *self, Args &&...args) -> R {
+            return std::invoke(**static_cast<F **>(self),
+                               std::forward<Args>(args)...);
+          },
+          [](void *dst, void *src) {
+            *static_cast<F **>(dst) = *static_cast<F **>(src);
+          },
+          [](void *self) { delete *static_cast<F **>(self); }};
+      return &table;
+    }
+  }
+
+  alignas(std::max_align_t) std::byte storage[Capacity];
+  const VTable *vtable = nullptr;
+
+  void Reset() {
+    if (vtable) {
+      vtable->destroy(storage);
+      vtable = nullptr;
+    }
+  }
+
+public:
+  MoveFunction() = default;
+  MoveFunction(std::nullptr_t) {}
+  template <typename TFunc, typename F = std::decay_t<TFunc>>
+    requires(!std::is_same_v<F, MoveFunction> &&
+             std::is_invocable_r_v<R, F &, Args...>)
+  MoveFunction(TFunc &&func) {
+    if constexpr (std::is_pointer_v<F> || std::is_member_pointer_v<F>) {
+      if (!func) {
+        return;
+      }
+    }
+    if constexpr (IS_INLINE<F>) {
+      ::new (storage) F(std::forward<TFunc>(func));
+    } else {
+      *reinterpret_cast<F **>(storage) = new F(std::forward<TFunc>(func));
+    }
+    vtable = Table<F>();
+  }
+  MoveFunction(MoveFunction &&other) noexcept : vtable(other.vtable) {
+    if (vtable) {
+      vtable->move(storage, other.storage);
+      other.vtable = nullptr;
+    }
+  }
+  MoveFunction &operator=(MoveFunction &&other) noexcept {
+    if (this != &other) {
+      Reset();
+      if (other.vtable) {
+        other.vtable->move(storage, other.storage);
+        vtable = other.vtable;
+        other.vtable = nullptr;
+      }
+    }
+    return *this;
+  }
+  MoveFunction &operator=(std::nullptr_t) {
+    Reset();
+    return *this;
+  }
+  MoveFunction(const MoveFunction &) = delete;
+  MoveFunction &operator=(const MoveFunction &) = delete;
+  ~MoveFunction() { Reset(); }
+
+  explicit operator bool() const { return vtable != nullptr; }
+  R operator()(Args... args) {
+    return vtable->invoke(storage, std::forward<Args>(args)...);
+  }
+};
+} // namespace John
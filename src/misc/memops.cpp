@@ -0,0 +1,226 @@
+#include "memops.h"
+#include <cstring>
+#if defined(__x86_64__) || defined(_M_X64)
+#define JOHN_MEMOPS_X64
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define JOHN_TARGET(isa)
+#else
+#include <cpuid.h>
+#define JOHN_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace John {
+// below this plain stores win, the data is likely read again soon
+static constexpr size_t NON_TEMPORAL_THRESHOLD = 4 * 1024 * 1024;
+
+static void ScalarCopy(void *dst, const void *src, size_t size) {
+  std::memcpy(dst, src, size);
+}
+static void ScalarFill(void *dst, uint32_t pattern, size_t size) {
+  auto *bytes = static_cast<uint8_t *>(dst);
+  uint8_t pattern_bytes[4];
+  std::memcpy(pattern_bytes, &pattern, 4);
+  if (pattern == pattern_bytes[0] * 0x01010101u) {
+    std::memset(dst, pattern_bytes[0], size);
+    return;
+  }
+  // seed a multiple of the pattern, then double it
+  size_t filled = size < 256 ? size : 256;
+  for (size_t i = 0; i < filled; ++i) {
+    bytes[i] = pattern_bytes[i & 3];
+  }
+  while (filled < size) {
+    size_t count = filled < size - filled ? filled : size - filled;
+    std::memcpy(bytes + filled, bytes, count);
+    filled += count;
+  }
+}
+// pattern as seen from an address offset bytes further
+static uint32_t RotatePattern(uint32_t pattern, size_t offset) {
+  unsigned shift = (offset & 3) * 8;
+  return shift ? (pattern >> shift) | (pattern << (32 - shift)) : pattern;
+}
+
+#if defined(JOHN_MEMOPS_X64)
+// Aligns the destination with plain stores, streams the body and finishes
+// the tail with plain stores again.
+template <size_t Width, typename TStream>
+static void StreamAligned(uint8_t *dst, size_t size, const TStream &stream,
+                          void (*head_tail)(uint8_t *dst, size_t offset,
+                                            size_t size, const void *ctx),
+                          const void *ctx) {
+  size_t head = (Width - (uintptr_t)dst % Width) % Width;
+  head_tail(dst, 0, head, ctx);
+  size_t body = (size - head) / Width * Width;
+  stream(dst + head, head, body);
+  head_tail(dst + head + body, head + body, size - head - body, ctx);
+}
+static void CopyPart(uint8_t *dst, size_t offset, size_t size,
+                     const void *src) {
+  std::memcpy(dst, static_cast<const uint8_t *>(src) + offset, size);
+}
+static void FillPart(uint8_t *dst, size_t offset, size_t size,
+                     const void *pattern) {
+  ScalarFill(dst, RotatePattern(*static_cast<const uint32_t *>(pattern), offset),
+             size);
+}
+
+JOHN_TARGET("avx2")
+static void Avx2Copy(void *dst, const void *src, size_t size) {
+  if (size < NON_TEMPORAL_THRESHOLD) {
+    std::memcpy(dst, src, size);
+    return;
+  }
+  auto *in = static_cast<const uint8_t *>(src);
+  StreamAligned<32>(
+      static_cast<uint8_t *>(dst), size,
+      [in](uint8_t *out, size_t offset, size_t body) JOHN_TARGET("avx2") {
+        for (size_t i = 0; i < body; i += 128) {
+          if (body - i < 128) {
+            for (; i < body; i += 32) {
+              _mm256_stream_si256(
+                  (__m256i *)(out + i),
+                  _mm256_loadu_si256((const __m256i *)(in + offset + i)));
+            }
+            break;
+          }
+          auto *from = (const __m256i *)(in + offset + i);
+          __m256i a = _mm256_loadu_si256(from);
+          __m256i b = _mm256_loadu_si256(from + 1);
+          __m256i c = _mm256_loadu_si256(from + 2);
+          __m256i d = _mm256_loadu_si256(from + 3);
+          auto *to = (__m256i *)(out + i);
+          _mm256_stream_si256(to, a);
+          _mm256_stream_si256(to + 1, b);
+          _mm256_stream_si256(to + 2, c);
+          _mm256_stream_si256(to + 3, d);
+        }
+        _mm_sfence();
+      },
+      CopyPart, src);
+}
+JOHN_TARGET("avx2")
+static void Avx2Fill(void *dst, uint32_t pattern, size_t size) {
+  if (size < NON_TEMPORAL_THRESHOLD) {
+    ScalarFill(dst, pattern, size);
+    return;
+  }
+  StreamAligned<32>(
+      static_cast<uint8_t *>(dst), size,
+      [pattern](uint8_t *out, size_t offset, size_t body) JOHN_TARGET("avx2") {
+        __m256i value = _mm256_set1_epi32((int)RotatePattern(pattern, offset));
+        for (size_t i = 0; i < body; i += 32) {
+          _mm256_stream_si256((__m256i *)(out + i), value);
+        }
+        _mm_sfence();
+      },
+      FillPart, &pattern);
+}
+JOHN_TARGET("avx512f")
+static void Avx512Copy(void *dst, const void *src, size_t size) {
+  if (size < NON_TEMPORAL_THRESHOLD) {
+    std::memcpy(dst, src, size);
+    return;
+  }
+  auto *in = static_cast<const uint8_t *>(src);
+  StreamAligned<64>(
+      static_cast<uint8_t *>(dst), size,
+      [in](uint8_t *out, size_t offset, size_t body) JOHN_TARGET("avx512f") {
+        for (size_t i = 0; i < body; i += 64) {
+          _mm512_stream_si512((__m512i *)(out + i),
+                              _mm512_loadu_si512(in + offset + i));
+        }
+        _mm_sfence();
+      },
+      CopyPart, src);
+}
+JOHN_TARGET("avx512f")
+static void Avx512Fill(void *dst, uint32_t pattern, size_t size) {
+  if (size < NON_TEMPORAL_THRESHOLD) {
+    ScalarFill(dst, pattern, size);
+    return;
+  }
+  StreamAligned<64>(
+      static_cast<uint8_t *>(dst), size,
+      [pattern](uint8_t *out, size_t offset, size_t body)
+          JOHN_TARGET("avx512f") {
+            __m512i value =
+                _mm512_set1_epi32((int)RotatePattern(pattern, offset));
+            for (size_t i = 0; i < body; i += 64) {
+              _mm512_stream_si512((__m512i *)(out + i), value);
+            }
+            _mm_sfence();
+          },
+      FillPart, &pattern);
+}
+
+static void CpuId(int leaf, int subleaf, int regs[4]) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  __cpuidex(regs, leaf, subleaf);
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+// the OS must also save the wider registers on context switches
+static uint64_t EnabledStates() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return _xgetbv(0);
+#else
+  uint32_t low, high;
+  __asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+  return ((uint64_t)high << 32) | low;
+#endif
+}
+#endif
+
+namespace {
+struct MemKernels {
+  void (*copy)(void *dst, const void *src, size_t size) = ScalarCopy;
+  void (*fill)(void *dst, uint32_t pattern, size_t size) = ScalarFill;
+  const char *name = "scalar";
+
+  MemKernels() {
+#if defined(JOHN_MEMOPS_X64)
+    int regs[4];
+    CpuId(0, 0, regs);
+    if (regs[0] < 7) {
+      return;
+    }
+    CpuId(1, 0, regs);
+    bool osxsave = regs[2] & (1 << 27);
+    if (!osxsave) {
+      return;
+    }
+    uint64_t states = EnabledStates();
+    CpuId(7, 0, regs);
+    bool avx2 = (regs[1] & (1 << 5)) && (states & 0x6) == 0x6;
+    bool avx512 = (regs[1] & (1 << 16)) && (states & 0xe6) == 0xe6;
+    if (avx512) {
+      copy = Avx512Copy;
+      fill = Avx512Fill;
+      name = "avx512";
+    } else if (avx2) {
+      copy = Avx2Copy;
+      fill = Avx2Fill;
+      name = "avx2";
+    }
+#endif
+  }
+};
+const MemKernels &Kernels() {
+  static const MemKernels kernels;
+  return kernels;
+}
+} // namespace
+
+void MemCopy(void *dst, const void *src, size_t size) {
+  Kernels().copy(dst, src, size);
+}
+void MemFill(void *dst, uint32_t pattern, size_t size) {
+  Kernels().fill(dst, pattern, size);
+}
+const char *MemKernelName() { return Kernels().name; }
+} // namespace John
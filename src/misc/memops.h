@@ -0,0 +1,14 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+namespace John {
+// memcpy/memset replacements for large buffers. Above a few MiB the
+// destination would only evict the cache, so the AVX2 and AVX-512 kernels
+// use non-temporal stores. The kernel is picked once by CPUID.
+// the ranges must not overlap
+void MemCopy(void *dst, const void *src, size_t size);
+// repeats the 4 bytes of pattern in memory order starting at dst
+void MemFill(void *dst, uint32_t pattern, size_t size);
+// name of the selected kernel, for logging
+const char *MemKernelName();
+} // namespace John
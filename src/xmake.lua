@@ -2,6 +2,7 @@ target("coro")
 _config_project({
     project_kind = "binary"
 })
+add_packages("lz4")
 on_load(function (target)
     local function rela(p)
         return path.relative(path.absolute(p, os.scriptdir()), os.projectdir())
@@ -10,5 +11,5 @@ on_load(function (target)
         target:add("syslinks", "Advapi32", "User32", "Gdi32","Shell32")
     end
     target:add("files", rela("./**.cpp"))
-    target:add("deps", "spdlog")
+    target:add("deps", "spdlog", "zstd", "xxhash")
 end)
\ No newline at end of file
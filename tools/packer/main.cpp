@@ -0,0 +1,277 @@
+#include "Pack.h"
+#include "misc/checksum.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Builds a pack file from a directory tree:
+//   packer <input dir> <output pack> [--manifest <file>] [--codec none|lz4|zstd]
+//          [--jobs <n>]
+// The manifest lists entry names in access order, one per line. Listed
+// entries are laid out first in that order, the rest follow sorted by name.
+namespace {
+using namespace John;
+
+// raw input processed at once, bounds the memory use on large trees
+constexpr size_t WINDOW_SIZE = 256 * 1024 * 1024;
+
+struct Options {
+  std::filesystem::path input;
+  std::filesystem::path output;
+  std::filesystem::path manifest;
+  std::optional<CompressionCodec> codec = CompressionCodec::Zstd;
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+};
+
+struct Source {
+  std::string name;
+  std::filesystem::path path;
+  uint64_t size;
+};
+
+struct Staged {
+  std::vector<uint8_t> raw;
+  // empty when the raw bytes are stored
+  std::vector<uint8_t> compressed;
+  PackEntry entry{};
+
+  std::span<const uint8_t> Stored() const {
+    return compressed.empty() ? std::span<const uint8_t>(raw)
+                              : std::span<const uint8_t>(compressed);
+  }
+};
+
+bool ParseOptions(int argc, const char **argv, Options *options) {
+  std::vector<std::string_view> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--manifest" && has_value) {
+      options->manifest = argv[++i];
+    } else if (arg == "--codec" && has_value) {
+      std::string_view codec = argv[++i];
+      if (codec == "none") {
+        options->codec.reset();
+      } else if (codec == "lz4") {
+        options->codec = CompressionCodec::Lz4;
+      } else if (codec == "zstd") {
+        options->codec = CompressionCodec::Zstd;
+      } else {
+        return false;
+      }
+    } else if (arg == "--jobs" && has_value) {
+      options->jobs = std::max(1, std::atoi(argv[++i]));
+    } else if (arg.starts_with("--")) {
+      return false;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (positional.size() != 2) {
+    return false;
+  }
+  options->input = positional[0];
+  options->output = positional[1];
+  return true;
+}
+
+// sources in layout order
+std::vector<Source> CollectSources(const Options &options) {
+  std::vector<Source> sources;
+  for (auto &item :
+       std::filesystem::recursive_directory_iterator(options.input)) {
+    if (!item.is_regular_file()) {
+      continue;
+    }
+    auto name = item.path().lexically_relative(options.input).generic_string();
+    sources.push_back({std::move(name), item.path(), item.file_size()});
+  }
+  std::unordered_map<std::string, size_t> rank;
+  if (!options.manifest.empty()) {
+    std::ifstream manifest(options.manifest);
+    std::string line;
+    while (std::getline(manifest, line)) {
+      if (!line.empty() && !rank.contains(line)) {
+        rank.emplace(line, rank.size());
+      }
+    }
+  }
+  auto rank_of = [&](const Source &source) {
+    auto iter = rank.find(source.name);
+    return iter != rank.end() ? iter->second : rank.size();
+  };
+  std::sort(sources.begin(), sources.end(),
+            [&](const Source &lhs, const Source &rhs) {
+              size_t lhs_rank = rank_of(lhs), rhs_rank = rank_of(rhs);
+              return lhs_rank != rhs_rank ? lhs_rank < rhs_rank
+                                          : lhs.name < rhs.name;
+            });
+  return sources;
+}
+
+// compresses unless the payload would not shrink, then hashes
+void Encode(const std::optional<CompressionCodec> &codec, Staged &staged) {
+  auto &raw = staged.raw;
+  if (codec && !raw.empty()) {
+    auto &out = staged.compressed;
+    out.resize(BlockCodec::PayloadBound(*codec, raw.size()));
+    out.resize(BlockCodec::EncodePayload(*codec, raw.data(), raw.size(),
+                                         out.data()));
+    if (out.size() >= raw.size()) {
+      out.clear();
+    }
+  }
+  auto stored = staged.Stored();
+  staged.entry.raw_size = raw.size();
+  staged.entry.stored_size = stored.size();
+  staged.entry.flags =
+      staged.compressed.empty() ? 0u : (uint32_t)PACK_ENTRY_COMPRESSED;
+  staged.entry.checksum = Xxh3(stored.data(), stored.size());
+}
+
+template <typename TFunc>
+void ParallelFor(size_t count, size_t jobs, const TFunc &task) {
+  std::atomic_size_t next = 0;
+  std::vector<std::jthread> threads;
+  for (size_t i = 0; i < std::min(jobs, count); ++i) {
+    threads.emplace_back([&]() {
+      for (size_t index; (index = next++) < count;) {
+        task(index);
+      }
+    });
+  }
+}
+
+uint64_t Align(uint64_t offset) {
+  return (offset + PackFormat::ALIGNMENT - 1) / PackFormat::ALIGNMENT *
+         PackFormat::ALIGNMENT;
+}
+
+int Build(const Options &options) {
+  auto sources = CollectSources(options);
+  IOCommandList list;
+  auto pack = list.ResolveNewFileHandle(options.output);
+  IOResult open_result;
+  list.Open(pack, IO_OPEN_CREATE | IO_OPEN_TRUNCATE,
+            {.result = &open_result});
+  IOService::Sync(IOService::Execute(list));
+  if (open_result.status != IOStatus::Success) {
+    SPDLOG_ERROR("Failed to create {}", options.output.string());
+    return 1;
+  }
+  std::vector<PackEntry> toc;
+  std::unordered_map<uint64_t, const std::string *> names;
+  uint64_t offset = PackFormat::ALIGNMENT;
+  uint64_t raw_total = 0;
+  for (size_t begin = 0; begin < sources.size();) {
+    // a window of sources, at least one however large it is
+    size_t end = begin;
+    uint64_t window_raw = 0;
+    do {
+      window_raw += sources[end++].size;
+    } while (end < sources.size() &&
+             window_raw + sources[end].size <= WINDOW_SIZE);
+    std::vector<Staged> staged(end - begin);
+    std::vector<IOResult> results(staged.size());
+    for (size_t i = 0; i < staged.size(); ++i) {
+      auto &source = sources[begin + i];
+      staged[i].raw.resize(source.size);
+      list.CopyFrom(FileDesc{list.ResolveFileHandle(source.path), 0,
+                             source.size},
+                    RawDataDesc{std::span(staged[i].raw)},
+                    {.result = &results[i]});
+    }
+    IOService::Sync(IOService::Execute(list));
+    for (size_t i = 0; i < staged.size(); ++i) {
+      if (results[i].status != IOStatus::Success) {
+        SPDLOG_ERROR("Failed to read {}", sources[begin + i].path.string());
+        return 1;
+      }
+    }
+    ParallelFor(staged.size(), options.jobs,
+                [&](size_t index) { Encode(options.codec, staged[index]); });
+
+    // lay the window out and write it with one preallocated region
+    uint64_t window_begin = offset;
+    for (size_t i = 0; i < staged.size(); ++i) {
+      auto &source = sources[begin + i];
+      auto &entry = staged[i].entry;
+      entry.name_hash = PackFormat::HashName(source.name);
+      auto [iter, inserted] = names.emplace(entry.name_hash, &source.name);
+      if (!inserted) {
+        SPDLOG_ERROR("Name hash collision between {} and {}", *iter->second,
+                     source.name);
+        return 1;
+      }
+      entry.offset = offset;
+      offset = Align(offset + entry.stored_size);
+      toc.push_back(entry);
+      raw_total += entry.raw_size;
+    }
+    list.Allocate(FileDesc{pack, window_begin, offset - window_begin});
+    for (auto &item : staged) {
+      auto stored = item.Stored();
+      list.CopyFrom(
+          RawDataDesc{std::span((uint8_t *)stored.data(), stored.size())},
+          FileDesc{pack, item.entry.offset, stored.size()},
+          {.result = &results[&item - staged.data()]});
+    }
+    IOService::Sync(IOService::Execute(list));
+    for (auto &result : results) {
+      if (result.status != IOStatus::Success) {
+        SPDLOG_ERROR("Failed to write {}", options.output.string());
+        return 1;
+      }
+    }
+    begin = end;
+  }
+
+  std::sort(toc.begin(), toc.end(),
+            [](const PackEntry &lhs, const PackEntry &rhs) {
+              return lhs.name_hash < rhs.name_hash;
+            });
+  PackHeader header{PackFormat::MAGIC, PackFormat::VERSION, toc.size(), offset,
+                    0};
+  size_t toc_size = toc.size() * sizeof(PackEntry);
+  IOResult results[4];
+  // sizes the file up to the TOC end, an empty input has no data window to
+  // extend it and would leave toc_offset past the end of file
+  list.Truncate(pack, offset + toc_size, {.result = &results[0]});
+  list.CopyFrom(RawDataDesc{std::span((uint8_t *)toc.data(), toc_size)},
+                FileDesc{pack, offset, toc_size}, {.result = &results[1]});
+  list.CopyFrom(RawDataDesc{std::span((uint8_t *)&header, sizeof(header))},
+                FileDesc{pack, 0, sizeof(header)}, {.result = &results[2]});
+  list.Flush(pack, IOFlushMode::Full, {.result = &results[3]});
+  list.Close(pack);
+  IOService::Sync(IOService::Execute(list));
+  for (auto &result : results) {
+    if (result.status != IOStatus::Success) {
+      SPDLOG_ERROR("Failed to write {}", options.output.string());
+      return 1;
+    }
+  }
+  SPDLOG_INFO("Packed {} files, {} bytes into {} bytes", toc.size(), raw_total,
+              offset + toc_size);
+  return 0;
+}
+} // namespace
+
+int main(const int argc, const char **argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    SPDLOG_ERROR("Usage: packer <input dir> <output pack> [--manifest <file>] "
+                 "[--codec none|lz4|zstd] [--jobs <n>]");
+    return 1;
+  }
+  IOService::Init();
+  auto disposer = OnExitScope([]() { IOService::Dispose(); });
+  return Build(options);
+}
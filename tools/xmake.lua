@@ -0,0 +1,16 @@
+target("packer")
+_config_project({
+    project_kind = "binary"
+})
+add_packages("lz4")
+on_load(function (target)
+    local function rela(p)
+        return path.relative(path.absolute(p, os.scriptdir()), os.projectdir())
+    end
+    if is_plat("windows") then
+        target:add("syslinks", "Advapi32", "User32", "Gdi32","Shell32")
+    end
+    target:add("files", rela("packer/*.cpp"), rela("../src/**.cpp|main.cpp"))
+    target:add("includedirs", rela("../src"))
+    target:add("deps", "spdlog", "zstd", "xxhash")
+end)
@@ -2,7 +2,7 @@ set_xmakever("2.8.1")
 add_rules("mode.debug", "mode.release")
 set_policy("build.ccache", false)
 includes( "scripts/xmake_configs.lua")
-includes("ext/spdlog","src")
+includes("ext/spdlog","ext/zstd","ext/xxhash","ext/lz4","src","tools")
 
 if is_arch("x64", "x86_64", "amd64") then
     if is_mode("debug") then 